@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include "camera.h"
 #include "matrix.h"
 
@@ -9,12 +10,19 @@ static camera_t camera = {
     .pitch = 0
 };
 
+// the view matrix is rebuilt only after the camera moves or turns, and the
+// version counts the rebuilds so anything derived from it can tell it's stale
+static mat4_t view_matrix;
+static bool is_view_matrix_dirty = true;
+static int view_version = 0;
+
 void init_camera(vec3_t position, vec3_t direction) {
     camera.position = position;
     camera.direction = direction;
     camera.forward_velocity = vec3_new(0, 0, 0);
     camera.yaw = 0.0;
     camera.pitch = 0.0;
+    is_view_matrix_dirty = true;
 }
 
 vec3_t get_camera_position(void) {
@@ -23,6 +31,7 @@ vec3_t get_camera_position(void) {
 
 void update_camera_position(vec3_t position) {
     camera.position = position;
+    is_view_matrix_dirty = true;
 }
 
 vec3_t get_camera_direction(void) {
@@ -47,6 +56,7 @@ float get_camera_yaw(void) {
 
 void rotate_camera_yaw(float angle) {
     camera.yaw += angle;
+    is_view_matrix_dirty = true;
 }
 
 float get_camera_pitch(void) {
@@ -55,6 +65,7 @@ float get_camera_pitch(void) {
 
 void rotate_camera_pitch(float angle) {
     camera.pitch += angle;
+    is_view_matrix_dirty = true;
 }
 
 vec3_t get_camera_lookat_target(void) {
@@ -73,3 +84,18 @@ vec3_t get_camera_lookat_target(void) {
     target = vec3_add(camera.position, camera.direction);
     return target;
 }
+
+const mat4_t* get_camera_view_matrix(void) {
+    if (is_view_matrix_dirty) {
+        vec3_t up_direction = { 0, 1, 0 };
+        vec3_t target = get_camera_lookat_target();
+        view_matrix = mat4_look_at(camera.position, target, up_direction);
+        is_view_matrix_dirty = false;
+        ++view_version;
+    }
+    return &view_matrix;
+}
+
+int get_camera_view_version(void) {
+    return view_version;
+}
@@ -1,6 +1,7 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "matrix.h"
 #include "vector.h"
 
 typedef struct {
@@ -24,5 +25,7 @@ float get_camera_pitch(void);
 void rotate_camera_pitch(float angle);
 
 vec3_t get_camera_lookat_target(void);
+const mat4_t* get_camera_view_matrix(void);
+int get_camera_view_version(void);
 
 #endif
@@ -1,35 +1,82 @@
 #include "clipping.h"
 
 #include <math.h>
+#include <stdbool.h>
 
 #define NUM_PLANES 6
 plane_t frustum_planes[NUM_PLANES];
 
+// the side planes on the edges of the screen, for rejecting faces that are
+// inside the guard band but can't be seen
+#define NUM_SCREEN_PLANES 4
+plane_t screen_planes[NUM_SCREEN_PLANES];
+
+// how far past the edges of the screen the side planes sit, as a multiple of
+// the screen's half width and height
+float guard_band_extent = DEFAULT_GUARD_BAND_EXTENT;
+
+// clamped to the screen edges below and the rasterizer's fixed point range
+// above; anything that isn't a number clips to the screen
+void set_guard_band_extent(float extent) {
+    if (!(extent >= 1.0f)) {
+        extent = 1.0f;
+    } else if (extent > MAX_GUARD_BAND_EXTENT) {
+        extent = MAX_GUARD_BAND_EXTENT;
+    }
+    guard_band_extent = extent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Guard band
+///////////////////////////////////////////////////////////////////////////////
+// Only the near and far planes have to be clipped against: near keeps w
+// positive for the perspective divide, far keeps the depth in range. The
+// rasterizer already clamps its bounding box to the clip rect and the line
+// drawer clips its steps, so a triangle poking out of the sides of the screen
+// is scissored there for free. The side planes are pushed out to the guard
+// band instead of sitting on the screen edges, and only triangles reaching
+// past it are cut, which keeps the sub-pixel coordinates well within range.
+// Passes whose plane has every vertex inside return before copying anything,
+// so for the common case the four side passes are a handful of dot products.
+///////////////////////////////////////////////////////////////////////////////
+
+// the four planes through the eye that bound the given half angles
+static void make_side_planes(plane_t planes[], float half_fov_x, float half_fov_y) {
+    float cos_half_fov_x = cos(half_fov_x);
+    float sin_half_fov_x = sin(half_fov_x);
+    float cos_half_fov_y = cos(half_fov_y);
+    float sin_half_fov_y = sin(half_fov_y);
+
+    planes[LEFT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    planes[LEFT_FRUSTUM_PLANE].normal.x = cos_half_fov_x;
+    planes[LEFT_FRUSTUM_PLANE].normal.y = 0;
+    planes[LEFT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
+
+    planes[RIGHT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    planes[RIGHT_FRUSTUM_PLANE].normal.x = -cos_half_fov_x;
+    planes[RIGHT_FRUSTUM_PLANE].normal.y = 0;
+    planes[RIGHT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
+
+    planes[TOP_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    planes[TOP_FRUSTUM_PLANE].normal.x = 0;
+    planes[TOP_FRUSTUM_PLANE].normal.y = -cos_half_fov_y;
+    planes[TOP_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
+
+    planes[BOTTOM_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    planes[BOTTOM_FRUSTUM_PLANE].normal.x = 0;
+    planes[BOTTOM_FRUSTUM_PLANE].normal.y = cos_half_fov_y;
+    planes[BOTTOM_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
+}
+
 void initialise_frustum_planes(float fov_x, float fov_y, float z_near, float z_far) {
-    float cos_half_fov_x = cos(fov_x / 2.0f);
-    float sin_half_fov_x = sin(fov_x / 2.0f);
-    float cos_half_fov_y = cos(fov_y / 2.0f);
-    float sin_half_fov_y = sin(fov_y / 2.0f);
-
-    frustum_planes[LEFT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-    frustum_planes[LEFT_FRUSTUM_PLANE].normal.x = cos_half_fov_x;
-    frustum_planes[LEFT_FRUSTUM_PLANE].normal.y = 0;
-    frustum_planes[LEFT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
-
-    frustum_planes[RIGHT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-    frustum_planes[RIGHT_FRUSTUM_PLANE].normal.x = -cos_half_fov_x;
-    frustum_planes[RIGHT_FRUSTUM_PLANE].normal.y = 0;
-    frustum_planes[RIGHT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
-
-    frustum_planes[TOP_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-    frustum_planes[TOP_FRUSTUM_PLANE].normal.x = 0;
-    frustum_planes[TOP_FRUSTUM_PLANE].normal.y = -cos_half_fov_y;
-    frustum_planes[TOP_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
-
-    frustum_planes[BOTTOM_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-    frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.x = 0;
-    frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.y = cos_half_fov_y;
-    frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
+    make_side_planes(screen_planes, fov_x / 2.0f, fov_y / 2.0f);
+
+    // widen the side planes' half angles so they meet the guard band
+    make_side_planes(
+        frustum_planes,
+        atan(tan(fov_x / 2.0f) * guard_band_extent),
+        atan(tan(fov_y / 2.0f) * guard_band_extent)
+    );
 
     frustum_planes[NEAR_FRUSTUM_PLANE].point = vec3_new(0, 0, z_near);
     frustum_planes[NEAR_FRUSTUM_PLANE].normal.x = 0;
@@ -42,6 +89,59 @@ void initialise_frustum_planes(float fov_x, float fov_y, float z_near, float z_f
     frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
 }
 
+// a bit per plane the point isn't strictly inside of. A face whose vertices
+// share a bit is wholly outside that plane, and a face with none of the
+// clipping planes' bits set would pass through every clipping pass untouched.
+uint16_t get_outcode(vec3_t point) {
+    uint16_t outcode = 0;
+    for (int plane = 0; plane < NUM_PLANES; ++plane) {
+        vec3_t to_point = vec3_sub(point, frustum_planes[plane].point);
+        if (vec3_dot(to_point, frustum_planes[plane].normal) <= 0) {
+            outcode |= 1 << plane;
+        }
+    }
+    for (int plane = 0; plane < NUM_SCREEN_PLANES; ++plane) {
+        if (vec3_dot(point, screen_planes[plane].normal) <= 0) {
+            outcode |= 1 << (SCREEN_OUTCODE_SHIFT + plane);
+        }
+    }
+    return outcode;
+}
+
+// the planes around what can actually be seen: the screen edges rather than
+// the guard band, then near and far
+static const plane_t* get_visible_plane(int plane) {
+    return plane < NUM_SCREEN_PLANES ? &screen_planes[plane] : &frustum_planes[plane];
+}
+
+static float get_plane_distance(const plane_t* plane, vec3_t point) {
+    return vec3_dot(vec3_sub(point, plane->point), plane->normal);
+}
+
+bool is_sphere_outside_frustum(vec3_t centre, float radius) {
+    for (int plane = 0; plane < NUM_PLANES; ++plane) {
+        if (get_plane_distance(get_visible_plane(plane), centre) < -radius) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// true when every point is outside the same plane, so the shape they bound
+// can't be seen; a shape across a corner of the frustum may still be kept
+bool are_points_outside_frustum(const vec3_t points[], int num_points) {
+    for (int plane = 0; plane < NUM_PLANES; ++plane) {
+        bool is_all_outside = true;
+        for (int i = 0; i < num_points && is_all_outside; ++i) {
+            is_all_outside = get_plane_distance(get_visible_plane(plane), points[i]) < 0;
+        }
+        if (is_all_outside) {
+            return true;
+        }
+    }
+    return false;
+}
+
 polygon_t create_polygon_from_triangle(
     vec3_t v0, vec3_t v1, vec3_t v2,
     tex2_t t0, tex2_t t1, tex2_t t2
@@ -77,6 +177,17 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
     vec3_t plane_point = frustum_planes[plane].point;
     vec3_t plane_normal = frustum_planes[plane].normal;
 
+    // nothing to cut when every vertex is strictly inside
+    float dots[MAX_NUM_POLY_VERTICES];
+    bool is_all_inside = true;
+    for (int i = 0; i < polygon->num_vertices; ++i) {
+        dots[i] = vec3_dot(vec3_sub(polygon->vertices[i], plane_point), plane_normal);
+        is_all_inside = is_all_inside && dots[i] > 0;
+    }
+    if (is_all_inside) {
+        return;
+    }
+
     vec3_t inside_vertices[MAX_NUM_POLY_VERTICES];
     tex2_t inside_texcoords[MAX_NUM_POLY_VERTICES];
     int num_inside_vertices = 0;
@@ -87,10 +198,10 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
     tex2_t* previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
 
     float current_dot;
-    float previous_dot = vec3_dot(vec3_sub(*previous_vertex, plane_point), plane_normal);
+    float previous_dot = dots[polygon->num_vertices - 1];
 
     while (current_vertex != &polygon->vertices[polygon->num_vertices]) {
-        current_dot = vec3_dot(vec3_sub(*current_vertex, plane_point), plane_normal);
+        current_dot = dots[current_vertex - polygon->vertices];
 
         // we've changed from inside or outside, or vice versa
         if (current_dot * previous_dot < 0) {
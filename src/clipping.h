@@ -1,12 +1,24 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "triangle.h"
 #include "vector.h"
 
 #define MAX_NUM_POLY_VERTICES 10
 #define MAX_NUM_POLY_TRIANGLES 10
 
+// side planes sit this many half screens from the centre, 1 clips to the screen
+#define DEFAULT_GUARD_BAND_EXTENT 4.0f
+
+// An edge inside the guard band spans up to extent * window width pixels.
+// The rasterizer keeps edge coefficients as ints in sub-pixels scaled by the
+// sub-pixel factor again, 2^8 a pixel (see make_edge_function), so that span
+// has to stay under 2^23 pixels. 1024 covers windows up to 4096 pixels
+// across with a factor of two to spare.
+#define MAX_GUARD_BAND_EXTENT 1024.0f
+
 enum {
     LEFT_FRUSTUM_PLANE,
     RIGHT_FRUSTUM_PLANE,
@@ -21,12 +33,29 @@ typedef struct {
     vec3_t normal;
 } plane_t;
 
+// outcodes hold a bit per frustum plane, then a bit per edge of the screen;
+// the two sets of side planes only differ when there is a guard band
+#define SCREEN_OUTCODE_SHIFT 6
+#define CLIP_OUTCODE_MASK ((1 << SCREEN_OUTCODE_SHIFT) - 1)
+
+// faces counted by how clipping dealt with them
+typedef struct {
+    int trivially_accepted; // every vertex inside every plane, not clipped
+    int trivially_rejected; // every vertex outside the same plane or screen edge, dropped
+    int clipped; // straddling at least one plane
+    int culled_meshes; // meshes whose bounds are wholly outside the frustum
+} clip_stats_t;
+
 typedef struct {
     vec3_t vertices[MAX_NUM_POLY_VERTICES];
     tex2_t texcoords[MAX_NUM_POLY_VERTICES];
     int num_vertices;
 } polygon_t;
 
+void set_guard_band_extent(float extent);
+uint16_t get_outcode(vec3_t point);
+bool is_sphere_outside_frustum(vec3_t centre, float radius);
+bool are_points_outside_frustum(const vec3_t points[], int num_points);
 void initialise_frustum_planes(float fov_x, float fov_y, float z_near, float z_far);
 polygon_t create_polygon_from_triangle(
     vec3_t v0, vec3_t v1, vec3_t v2,
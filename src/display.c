@@ -1,11 +1,25 @@
 #include <math.h>
+#include <string.h>
 #include "display.h"
 
 static SDL_Window* window = NULL;
 static SDL_Renderer* renderer = NULL;
 
 static uint32_t* colour_buffer = NULL;
-static float* z_buffer = NULL;
+static void* z_buffer = NULL; // laid out as depth_format, see display.h
+static uint32_t* visibility_buffer = NULL;
+static float* hi_z_buffer = NULL;
+static int hi_z_buffer_width = 0;
+static int hi_z_buffer_height = 0;
+
+// clears are deferred per hi-z tile: clearing only sets the tile's flags and
+// the clear value is written the first time the tile is drawn into, or for
+// colour, when the frame is presented
+#define TILE_COLOUR_CLEARED 1
+#define TILE_DEPTH_CLEARED 2
+static uint8_t* tile_clear_flags = NULL;
+static uint32_t clear_colour = 0xFF000000;
+static uint32_t clear_grid_colour = 0xFF333333;
 
 static SDL_Texture* colour_buffer_texture = NULL;
 static int window_width = 320;
@@ -13,6 +27,32 @@ static int window_height = 240;
 
 static int render_method = RENDER_WIRE;
 static int cull_method = CULL_NONE;
+static int depth_format = DEPTH_FLOAT;
+static float depth_near_plane = 1.0f;
+
+// the buffers the rasterizer draws into, without a window to show them in
+void initialise_frame_buffers(int width, int height) {
+    window_width = width;
+    window_height = height;
+
+    colour_buffer = (uint32_t*) malloc(sizeof(uint32_t) * window_width * window_height);
+    // sized for the widest format so the format can change between frames
+    z_buffer = malloc(sizeof(float) * window_width * window_height);
+    visibility_buffer = (uint32_t*) malloc(sizeof(uint32_t) * window_width * window_height);
+
+    hi_z_buffer_width = (window_width + HI_Z_TILE_SIZE - 1) / HI_Z_TILE_SIZE;
+    hi_z_buffer_height = (window_height + HI_Z_TILE_SIZE - 1) / HI_Z_TILE_SIZE;
+    hi_z_buffer = (float*) malloc(sizeof(float) * hi_z_buffer_width * hi_z_buffer_height);
+    tile_clear_flags = (uint8_t*) calloc(hi_z_buffer_width * hi_z_buffer_height, sizeof(uint8_t));
+}
+
+void free_frame_buffers(void) {
+    free(tile_clear_flags);
+    free(hi_z_buffer);
+    free(visibility_buffer);
+    free(z_buffer);
+    free(colour_buffer);
+}
 
 bool initialise_window(void) {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -48,8 +88,7 @@ bool initialise_window(void) {
         return false;
     }
 
-    colour_buffer = (uint32_t*) malloc(sizeof(uint32_t) * window_width * window_height);
-    z_buffer = (float*) malloc(sizeof(float) * window_width * window_height);
+    initialise_frame_buffers(window_width, window_height);
 
     colour_buffer_texture = SDL_CreateTexture(
         renderer,
@@ -76,6 +115,10 @@ void set_render_method(int method) {
     render_method = method;
 }
 
+int get_render_method(void) {
+    return render_method;
+}
+
 void set_cull_method(int method) {
     cull_method = method;
 }
@@ -84,70 +127,135 @@ bool is_cull_backface(void) {
     return cull_method == CULL_BACKFACE;
 }
 
-bool should_render_filled_triangles(void) {
-    return render_method == RENDER_FILL_TRIANGLE || render_method == RENDER_FILL_TRIANGLE_WIRE;
+bool should_render_visibility_buffer(void) {
+    return render_method == RENDER_VISIBILITY_BUFFER;
 }
 
-bool should_render_textured_triangles(void) {
-    return render_method == RENDER_TEXTURED || render_method == RENDER_TEXTURED_WIRE;
+// a NULL clip rect covers the whole window
+SDL_Rect get_clip_rect(const SDL_Rect* clip) {
+    if (clip == NULL) {
+        SDL_Rect window_rect = { 0, 0, window_width, window_height };
+        return window_rect;
+    }
+    return *clip;
 }
 
-bool should_render_wireframe(void) {
-    return render_method == RENDER_WIRE 
-        || render_method == RENDER_WIRE_VERTEX
-        || render_method == RENDER_FILL_TRIANGLE_WIRE
-        || render_method == RENDER_TEXTURED_WIRE;
+// floor and ceiling of a / b for b > 0, whatever the sign of a
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
 }
 
-bool should_render_wire_vertex(void) {
-    return render_method == RENDER_WIRE_VERTEX;
+static int64_t ceil_div(int64_t a, int64_t b) {
+    return -floor_div(-a, b);
 }
 
-void draw_grid(void) {
-    for (int y = 0; y < window_height; y += 10) {
-        for (int x = 0; x < window_width; x += 10) {
-            colour_buffer[(window_width * y) + x] = 0xFF333333;
+// Bresenham in integer steps along the major axis. Step i lands on minor
+// offset floor((2 * i * minor_length + major_length) / (2 * major_length)),
+// so the range of steps inside the clip rect can be solved for directly and
+// the error term started part way along the line. A line cut up by the tile
+// renderer's clip rects therefore lights exactly the pixels it would have
+// drawn whole, and the loop itself never needs a bounds check.
+void draw_line(int x0, int y0, int x1, int y1, uint32_t colour, const SDL_Rect* clip) {
+    SDL_Rect rect = get_clip_rect(clip);
+
+    int delta_x = x1 - x0;
+    int delta_y = y1 - y0;
+    bool x_major = abs(delta_x) >= abs(delta_y);
+
+    int major_start = x_major ? x0 : y0;
+    int minor_start = x_major ? y0 : x0;
+    int major_dir = (x_major ? delta_x : delta_y) < 0 ? -1 : 1;
+    int minor_dir = (x_major ? delta_y : delta_x) < 0 ? -1 : 1;
+    int64_t major_length = abs(x_major ? delta_x : delta_y);
+    int64_t minor_length = abs(x_major ? delta_y : delta_x);
+
+    int major_min = x_major ? rect.x : rect.y;
+    int major_max = major_min + (x_major ? rect.w : rect.h) - 1;
+    int minor_min = x_major ? rect.y : rect.x;
+    int minor_max = minor_min + (x_major ? rect.h : rect.w) - 1;
+
+    // steps whose major coordinate is inside the rect
+    int64_t first_step = major_dir > 0 ? major_min - major_start : major_start - major_max;
+    int64_t last_step = major_dir > 0 ? major_max - major_start : major_start - major_min;
+    if (first_step < 0) first_step = 0;
+    if (last_step > major_length) last_step = major_length;
+
+    // minor offsets inside the rect, then the steps that land on them
+    int64_t lowest_offset = minor_dir > 0 ? minor_min - minor_start : minor_start - minor_max;
+    int64_t highest_offset = minor_dir > 0 ? minor_max - minor_start : minor_start - minor_min;
+    if (minor_length == 0) {
+        if (lowest_offset > 0 || highest_offset < 0) {
+            return;
         }
+    } else {
+        int64_t lowest_step = ceil_div(2 * major_length * lowest_offset - major_length, 2 * minor_length);
+        int64_t highest_step = floor_div(2 * major_length * (highest_offset + 1) - major_length - 1, 2 * minor_length);
+        if (first_step < lowest_step) first_step = lowest_step;
+        if (last_step > highest_step) last_step = highest_step;
     }
-}
-
-void draw_pixel(int x, int y, uint32_t colour) {
-    if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+    if (first_step > last_step) {
         return;
     }
-    colour_buffer[(window_width * y) + x] = colour;
-}
 
-void draw_line(int x0, int y0, int x1, int y1, uint32_t colour) {
-    // https://en.wikipedia.org/wiki/Digital_differential_analyzer_(graphics_algorithm)
-
-    int delta_x = x1 - x0;
-    int delta_y = y1 - y0;
-
-    int longest_side_length = abs(delta_x) >= abs(delta_y) ? abs(delta_x) : abs(delta_y);
+    int64_t error_step = 2 * minor_length;
+    int64_t error_wrap = 2 * major_length;
+    int64_t error = 2 * first_step * minor_length + major_length;
+    int64_t minor_offset = error_wrap > 0 ? error / error_wrap : 0;
+    if (error_wrap > 0) {
+        error %= error_wrap;
+    }
 
-    float x_inc = delta_x / (float) longest_side_length;
-    float y_inc = delta_y / (float) longest_side_length;
+    int major = major_start + major_dir * (int) first_step;
+    int minor = minor_start + minor_dir * (int) minor_offset;
+    int x = x_major ? major : minor;
+    int y = x_major ? minor : major;
+    int x_step = x_major ? major_dir : 0;
+    int y_step = x_major ? 0 : major_dir;
+    int x_minor_step = x_major ? 0 : minor_dir;
+    int y_minor_step = x_major ? minor_dir : 0;
+
+    for (int64_t step = first_step; step <= last_step; ++step) {
+        materialise_tile(x, y);
+        colour_buffer[(window_width * y) + x] = colour;
+
+        x += x_step;
+        y += y_step;
+        error += error_step;
+        if (error >= error_wrap) {
+            error -= error_wrap;
+            x += x_minor_step;
+            y += y_minor_step;
+        }
+    }
+}
 
-    float current_x = x0;
-    float current_y = y0;
-    for (int i = 0; i <= longest_side_length; ++i) {
-        draw_pixel(round(current_x), round(current_y), colour);
+void draw_rect(int start_x, int start_y, int width, int height, uint32_t colour, const SDL_Rect* clip) {
+    SDL_Rect rect = get_clip_rect(clip);
+    int min_x = start_x > rect.x ? start_x : rect.x;
+    int min_y = start_y > rect.y ? start_y : rect.y;
+    int max_x = start_x + width < rect.x + rect.w ? start_x + width : rect.x + rect.w;
+    int max_y = start_y + height < rect.y + rect.h ? start_y + height : rect.y + rect.h;
+    if (min_x >= max_x || min_y >= max_y) {
+        return;
+    }
 
-        current_x += x_inc;
-        current_y += y_inc;
+    for (int y = min_y; y < max_y; y += HI_Z_TILE_SIZE - y % HI_Z_TILE_SIZE) {
+        for (int x = min_x; x < max_x; x += HI_Z_TILE_SIZE - x % HI_Z_TILE_SIZE) {
+            materialise_tile(x, y);
+        }
     }
-}
 
-void draw_rect(int start_x, int start_y, int width, int height, uint32_t colour) {
-    for (int y = start_y; y < start_y + height; ++y) {
-        for (int x = start_x; x < start_x + width; ++x) {
-            draw_pixel(x, y, colour);
+    for (int y = min_y; y < max_y; ++y) {
+        uint32_t* row = colour_buffer + (window_width * y);
+        for (int x = min_x; x < max_x; ++x) {
+            row[x] = colour;
         }
     }
 }
 
 void render_colour_buffer(void) {
+    resolve_fast_clears(NULL);
+
     SDL_UpdateTexture(
         colour_buffer_texture,
         NULL,
@@ -159,35 +267,277 @@ void render_colour_buffer(void) {
     SDL_RenderPresent(renderer);
 }
 
-void clear_colour_buffer(uint32_t colour) {
-    for (int i = 0; i < window_width * window_height; ++i) {
-        colour_buffer[i] = colour;
+///////////////////////////////////////////////////////////////////////////////
+// Fast clears
+///////////////////////////////////////////////////////////////////////////////
+// Clearing a rect only flags the hi-z tiles inside it. Anything that writes
+// to a tile calls materialise_tile() first, which fills in whichever clears
+// are still pending, so tiles nothing is drawn into never have their depth
+// touched at all. Colour clears still pending at the end of the frame are
+// expanded by resolve_fast_clears(). Clip rects are expected to line up with
+// the tiles, as the window and the tile renderer's tiles do.
+///////////////////////////////////////////////////////////////////////////////
+static uint8_t* get_tile_clear_flags(int x, int y) {
+    return &tile_clear_flags[(hi_z_buffer_width * (y / HI_Z_TILE_SIZE)) + (x / HI_Z_TILE_SIZE)];
+}
+
+static void set_tile_clear_flags(const SDL_Rect* rect, uint8_t flags) {
+    for (int y = rect->y / HI_Z_TILE_SIZE; y * HI_Z_TILE_SIZE < rect->y + rect->h; ++y) {
+        for (int x = rect->x / HI_Z_TILE_SIZE; x * HI_Z_TILE_SIZE < rect->x + rect->w; ++x) {
+            tile_clear_flags[(hi_z_buffer_width * y) + x] |= flags;
+        }
     }
 }
 
-void clear_z_buffer(void) {
-    for (int i = 0; i < window_width * window_height; ++i) {
-        z_buffer[i] = 1.0;
+// the tile's pixels, clamped to the window
+static SDL_Rect get_tile_rect(int x, int y) {
+    SDL_Rect rect = {
+        .x = x - x % HI_Z_TILE_SIZE,
+        .y = y - y % HI_Z_TILE_SIZE,
+        .w = HI_Z_TILE_SIZE,
+        .h = HI_Z_TILE_SIZE
+    };
+    if (rect.x + rect.w > window_width) rect.w = window_width - rect.x;
+    if (rect.y + rect.h > window_height) rect.h = window_height - rect.y;
+    return rect;
+}
+
+// the background with a dot of the grid every 10 pixels
+static void fill_cleared_colour(const SDL_Rect* rect) {
+    int first_grid_x = rect->x + (10 - rect->x % 10) % 10;
+    for (int y = rect->y; y < rect->y + rect->h; ++y) {
+        uint32_t* row = colour_buffer + (window_width * y);
+        for (int x = rect->x; x < rect->x + rect->w; ++x) {
+            row[x] = clear_colour;
+        }
+        if (y % 10 == 0) {
+            for (int x = first_grid_x; x < rect->x + rect->w; x += 10) {
+                row[x] = clear_grid_colour;
+            }
+        }
     }
 }
 
-float get_z_buffer_at(int x, int y) {
-    if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
-        return 1.0f;
+// only the float format clears to anything other than zero; the visibility
+// buffer is cleared with the depth it belongs to
+static void fill_cleared_depth(const SDL_Rect* rect) {
+    int bytes_per_pixel = get_depth_bytes_per_pixel();
+    for (int y = rect->y; y < rect->y + rect->h; ++y) {
+        if (depth_format == DEPTH_FLOAT) {
+            float* row = get_z_buffer_row(y);
+            for (int x = rect->x; x < rect->x + rect->w; ++x) {
+                row[x] = 1.0;
+            }
+        } else {
+            uint8_t* row = get_z_buffer_row(y);
+            memset(row + rect->x * bytes_per_pixel, 0, rect->w * bytes_per_pixel);
+        }
+
+        if (should_render_visibility_buffer()) {
+            uint32_t* visibility_row = visibility_buffer + (window_width * y);
+            for (int x = rect->x; x < rect->x + rect->w; ++x) {
+                visibility_row[x] = NO_TRIANGLE_ID;
+            }
+        }
     }
-    return z_buffer[(window_width * y) + x];
 }
 
-void update_z_buffer_at(int x, int y, float value) {
-    if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+// writes any clear still pending in the tile holding the pixel
+void materialise_tile(int x, int y) {
+    uint8_t* flags = get_tile_clear_flags(x, y);
+    if (*flags == 0) {
         return;
     }
-    z_buffer[(window_width * y) + x] = value;
+
+    SDL_Rect rect = get_tile_rect(x, y);
+    if (*flags & TILE_COLOUR_CLEARED) {
+        fill_cleared_colour(&rect);
+    }
+    if (*flags & TILE_DEPTH_CLEARED) {
+        fill_cleared_depth(&rect);
+    }
+    *flags = 0;
+}
+
+bool is_tile_depth_cleared(int x, int y) {
+    return (*get_tile_clear_flags(x, y) & TILE_DEPTH_CLEARED) != 0;
+}
+
+// writes the colour of tiles nothing was drawn into, a run of neighbouring
+// tiles at a time; depth can stay pending since nothing reads it before the
+// next clear
+void resolve_fast_clears(const SDL_Rect* clip) {
+    SDL_Rect rect = get_clip_rect(clip);
+    int first_tile_x = rect.x / HI_Z_TILE_SIZE;
+    int end_tile_x = (rect.x + rect.w + HI_Z_TILE_SIZE - 1) / HI_Z_TILE_SIZE;
+
+    for (int y = rect.y / HI_Z_TILE_SIZE; y * HI_Z_TILE_SIZE < rect.y + rect.h; ++y) {
+        uint8_t* flags = &tile_clear_flags[hi_z_buffer_width * y];
+        int x = first_tile_x;
+        while (x < end_tile_x) {
+            if (!(flags[x] & TILE_COLOUR_CLEARED)) {
+                ++x;
+                continue;
+            }
+
+            int run_start = x;
+            for (; x < end_tile_x && (flags[x] & TILE_COLOUR_CLEARED); ++x) {
+                flags[x] &= ~TILE_COLOUR_CLEARED;
+            }
+
+            SDL_Rect run_rect = get_tile_rect(run_start * HI_Z_TILE_SIZE, y * HI_Z_TILE_SIZE);
+            run_rect.w = x * HI_Z_TILE_SIZE - run_rect.x;
+            if (run_rect.x + run_rect.w > window_width) {
+                run_rect.w = window_width - run_rect.x;
+            }
+            fill_cleared_colour(&run_rect);
+        }
+    }
+}
+
+// the grid is part of the clear value, so it costs nothing under geometry
+void clear_colour_buffer(uint32_t colour, uint32_t grid_colour, const SDL_Rect* clip) {
+    SDL_Rect rect = get_clip_rect(clip);
+    clear_colour = colour;
+    clear_grid_colour = grid_colour;
+    set_tile_clear_flags(&rect, TILE_COLOUR_CLEARED);
+}
+
+void clear_z_buffer(const SDL_Rect* clip) {
+    SDL_Rect rect = get_clip_rect(clip);
+    set_tile_clear_flags(&rect, TILE_DEPTH_CLEARED);
+
+    // 1.0 is never nearer than anything written, so it is a safe bound even
+    // for hi-z tiles only partly covered by the rect
+    for (int y = rect.y / HI_Z_TILE_SIZE; y * HI_Z_TILE_SIZE < rect.y + rect.h; ++y) {
+        for (int x = rect.x / HI_Z_TILE_SIZE; x * HI_Z_TILE_SIZE < rect.x + rect.w; ++x) {
+            hi_z_buffer[(hi_z_buffer_width * y) + x] = 1.0;
+        }
+    }
+}
+
+uint32_t* get_colour_buffer(void) {
+    return colour_buffer;
+}
+
+void set_depth_format(int format) {
+    depth_format = format;
+}
+
+int get_depth_format(void) {
+    return depth_format;
+}
+
+// the unorm formats store z_near / w, which is 1 on the near plane
+void set_depth_near_plane(float z_near) {
+    depth_near_plane = z_near;
+}
+
+int get_depth_bytes_per_pixel(void) {
+    switch (depth_format) {
+        case DEPTH_UNORM16:
+            return 2;
+        case DEPTH_UNORM24:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+// multiplies 1/w into the integer range of the current unorm format
+float get_depth_unorm_scale(void) {
+    switch (depth_format) {
+        case DEPTH_UNORM16:
+            return depth_near_plane * DEPTH_UNORM16_MAX;
+        case DEPTH_UNORM24:
+            return depth_near_plane * DEPTH_UNORM24_MAX;
+        default:
+            return 1.0f;
+    }
+}
+
+void* get_z_buffer_row(int y) {
+    return (uint8_t*) z_buffer + (size_t) y * window_width * get_depth_bytes_per_pixel();
+}
+
+// triangle ids of the visibility pass, NO_TRIANGLE_ID where nothing was drawn
+uint32_t* get_visibility_buffer(void) {
+    return visibility_buffer;
+}
+
+// the stored depth at a pixel as the float format's 1 - 1/w, so every
+// format can share the hi-z buffer; rounding keeps the order of the codes
+static float get_depth_as_float(const void* row, int x) {
+    switch (depth_format) {
+        case DEPTH_REVERSED_FLOAT:
+            return 1.0f - ((const float*) row)[x];
+        case DEPTH_UNORM16:
+            return 1.0f - ((const uint16_t*) row)[x] / get_depth_unorm_scale();
+        case DEPTH_UNORM24: {
+            const uint8_t* pixel = (const uint8_t*) row + x * 3;
+            uint32_t code = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+            return 1.0f - code / get_depth_unorm_scale();
+        }
+        default:
+            return ((const float*) row)[x];
+    }
+}
+
+// pixels that have had something drawn into them since the z buffer was cleared
+int count_covered_pixels(void) {
+    int num_covered = 0;
+    for (int tile_y = 0; tile_y < hi_z_buffer_height; ++tile_y) {
+        for (int tile_x = 0; tile_x < hi_z_buffer_width; ++tile_x) {
+            if (tile_clear_flags[(hi_z_buffer_width * tile_y) + tile_x] & TILE_DEPTH_CLEARED) {
+                continue;
+            }
+
+            SDL_Rect rect = get_tile_rect(tile_x * HI_Z_TILE_SIZE, tile_y * HI_Z_TILE_SIZE);
+            for (int y = rect.y; y < rect.y + rect.h; ++y) {
+                const void* row = get_z_buffer_row(y);
+                for (int x = rect.x; x < rect.x + rect.w; ++x) {
+                    if (get_depth_as_float(row, x) < 1.0) {
+                        ++num_covered;
+                    }
+                }
+            }
+        }
+    }
+    return num_covered;
+}
+
+// the farthest depth in the tile holding the pixel, anything at or beyond it
+// is hidden across the whole tile
+float get_hi_z_buffer_at(int x, int y) {
+    return hi_z_buffer[(hi_z_buffer_width * (y / HI_Z_TILE_SIZE)) + (x / HI_Z_TILE_SIZE)];
+}
+
+// recompute the farthest depth of the tile holding the pixel
+void update_hi_z_buffer_tile(int x, int y) {
+    int tile_x = x / HI_Z_TILE_SIZE;
+    int tile_y = y / HI_Z_TILE_SIZE;
+
+    int x_start = tile_x * HI_Z_TILE_SIZE;
+    int y_start = tile_y * HI_Z_TILE_SIZE;
+    int x_end = x_start + HI_Z_TILE_SIZE < window_width ? x_start + HI_Z_TILE_SIZE : window_width;
+    int y_end = y_start + HI_Z_TILE_SIZE < window_height ? y_start + HI_Z_TILE_SIZE : window_height;
+
+    float farthest = get_depth_as_float(get_z_buffer_row(y_start), x_start);
+    for (int j = y_start; j < y_end; ++j) {
+        const void* row = get_z_buffer_row(j);
+        for (int i = x_start; i < x_end; ++i) {
+            float z = get_depth_as_float(row, i);
+            if (z > farthest) {
+                farthest = z;
+            }
+        }
+    }
+
+    hi_z_buffer[(hi_z_buffer_width * tile_y) + tile_x] = farthest;
 }
 
 void destroy_window(void) {
-    free(z_buffer);
-    free(colour_buffer);
+    free_frame_buffers();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
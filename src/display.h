@@ -8,39 +8,71 @@
 #define FPS 30
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// the hierarchical z buffer keeps the farthest depth of each tile
+#define HI_Z_TILE_SIZE 8
+
 enum cull_method {
     CULL_NONE,
     CULL_BACKFACE
 };
 
+// the z buffer layout; all but the float format are reversed, nearer
+// pixels store larger values and the buffer clears to zero
+enum depth_format {
+    DEPTH_FLOAT,          // 1 - 1/w, cleared to 1
+    DEPTH_REVERSED_FLOAT, // 1/w
+    DEPTH_UNORM16,        // z_near / w in 16 bit fixed point
+    DEPTH_UNORM24,        // z_near / w in 24 bit fixed point, packed in 3 bytes
+    NUM_DEPTH_FORMATS
+};
+
+#define DEPTH_UNORM16_MAX 0xFFFF
+#define DEPTH_UNORM24_MAX 0xFFFFFF
+
+// marks visibility buffer pixels no triangle has been drawn into
+#define NO_TRIANGLE_ID UINT32_MAX
+
 enum render_method {
     RENDER_WIRE,
     RENDER_WIRE_VERTEX,
     RENDER_FILL_TRIANGLE,
     RENDER_FILL_TRIANGLE_WIRE,
     RENDER_TEXTURED,
-    RENDER_TEXTURED_WIRE
+    RENDER_TEXTURED_WIRE,
+    RENDER_VISIBILITY_BUFFER,
+    NUM_RENDER_METHODS
 };
 
 bool initialise_window(void);
+void initialise_frame_buffers(int width, int height);
+void free_frame_buffers(void);
 int get_window_width(void);
 int get_window_height(void);
 void set_render_method(int render_method);
+int get_render_method(void);
 void set_cull_method(int cull_method);
 bool is_cull_backface(void);
-bool should_render_filled_triangles(void);
-bool should_render_textured_triangles(void);
-bool should_render_wireframe(void);
-bool should_render_wire_vertex(void);
-void draw_grid(void);
-void draw_pixel(int x, int y, uint32_t colour);
-void draw_line(int x0, int y0, int x1, int y1, uint32_t colour);
-void draw_rect(int start_x, int start_y, int width, int height, uint32_t colour);
+bool should_render_visibility_buffer(void);
+SDL_Rect get_clip_rect(const SDL_Rect* clip);
+void draw_line(int x0, int y0, int x1, int y1, uint32_t colour, const SDL_Rect* clip);
+void draw_rect(int start_x, int start_y, int width, int height, uint32_t colour, const SDL_Rect* clip);
 void render_colour_buffer(void);
-void clear_colour_buffer(uint32_t colour);
-void clear_z_buffer(void);
-float get_z_buffer_at(int x, int y);
-void update_z_buffer_at(int x, int y, float value);
+void clear_colour_buffer(uint32_t colour, uint32_t grid_colour, const SDL_Rect* clip);
+void clear_z_buffer(const SDL_Rect* clip);
+void materialise_tile(int x, int y);
+bool is_tile_depth_cleared(int x, int y);
+void resolve_fast_clears(const SDL_Rect* clip);
+uint32_t* get_colour_buffer(void);
+void set_depth_format(int format);
+int get_depth_format(void);
+void set_depth_near_plane(float z_near);
+int get_depth_bytes_per_pixel(void);
+float get_depth_unorm_scale(void);
+void* get_z_buffer_row(int y);
+uint32_t* get_visibility_buffer(void);
+int count_covered_pixels(void);
+float get_hi_z_buffer_at(int x, int y);
+void update_hi_z_buffer_tile(int x, int y);
 void destroy_window(void);
 
 #endif
@@ -2,6 +2,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL.h>
 #include "upng.h"
 #include "array.h"
@@ -12,12 +14,29 @@
 #include "matrix.h"
 #include "mesh.h"
 #include "texture.h"
+#include "threads.h"
+#include "tiles.h"
 #include "triangle.h"
 #include "vector.h"
 
-#define MAX_TRIANGLES_PER_MESH 10000
-triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
-int num_triangles_to_render = 0;
+// everything one frame's geometry reads from the camera and writes for the
+// rasterizer, so a frame can be built while the one before it is drawn
+typedef struct {
+    vec3_t camera_position;
+    mat4_t view_matrix;
+    int view_version;
+    triangle_setup_t* triangles_to_render; // reset each frame, grown to the largest frame seen
+    int num_triangles_to_render;
+    int triangles_capacity;
+    int num_triangle_list_grows; // allocations by the triangle lists up to this frame
+    clip_stats_t clip_stats;
+} frame_geometry_t;
+
+// update builds geometry_frame and render draws render_frame; they are the
+// same frame unless frames are pipelined
+frame_geometry_t frame_geometry[2];
+frame_geometry_t* geometry_frame = &frame_geometry[0];
+frame_geometry_t* render_frame = &frame_geometry[0];
 
 bool is_running = false;
 int previous_frame_time = 0;
@@ -25,9 +44,50 @@ float delta_time = 0;
 
 mat4_t proj_matrix;
 
+int num_render_threads = 0;
+thread_pool_t* geometry_thread_pool = NULL;
+
+bool is_pipelined = false;
+SDL_Thread* geometry_thread = NULL;
+SDL_sem* geometry_start_semaphore = NULL;
+SDL_sem* geometry_done_semaphore = NULL;
+bool should_stop_geometry_thread = false;
+
+#define MAX_COMMAND_LINE_MESHES 8
+char* command_line_meshes[MAX_COMMAND_LINE_MESHES];
+int num_command_line_meshes = 0;
+
+// indexed by depth_format, as passed to --depth
+const char* depth_format_names[NUM_DEPTH_FORMATS] = { "float", "reversed", "unorm16", "unorm24" };
+int depth_format = DEPTH_FLOAT;
+
+bool should_sort_triangles = true;
+triangle_setup_t* sorted_triangles = NULL; // swapped with the frame's list after sorting
+int sorted_triangles_capacity = 0;
+
+// only touched by whichever thread builds the geometry
+int num_triangle_list_grows = 0;
+
+bool should_print_stats = false;
+int previous_stats_time = 0;
+raster_stats_t frame_stats;
+
 void setup(void) {
+    initialise_rasterizer();
+    initialise_batch_transforms();
+
+    // default to one render thread per core
+    if (num_render_threads <= 0) {
+        num_render_threads = SDL_GetCPUCount();
+    }
+    if (num_render_threads > 1) {
+        initialise_tile_renderer(num_render_threads);
+        geometry_thread_pool = create_thread_pool(num_render_threads);
+    }
+
     set_render_method(RENDER_TEXTURED);
     set_cull_method(CULL_BACKFACE);
+    set_depth_format(depth_format);
 
     init_light(vec3_new(0, 0, 1));
 
@@ -38,9 +98,24 @@ void setup(void) {
     float znear = 0.1;
     float zfar = 100.0;
     proj_matrix = mat4_make_perspective(fov_y, aspect_ratio_y, znear, zfar);
+    set_depth_near_plane(znear);
 
     initialise_frustum_planes(fov_x, fov_y, znear, zfar);
 
+    if (num_command_line_meshes > 0) {
+        // line the named assets up side by side in front of the camera
+        for (int i = 0; i < num_command_line_meshes; ++i) {
+            char obj_filename[256];
+            char png_filename[256];
+            snprintf(obj_filename, sizeof(obj_filename), "assets/%s.obj", command_line_meshes[i]);
+            snprintf(png_filename, sizeof(png_filename), "assets/%s.png", command_line_meshes[i]);
+
+            float x = (i - (num_command_line_meshes - 1) / 2.0f) * 4;
+            load_mesh(obj_filename, png_filename, vec3_new(1, 1, 1), vec3_new(x, 0, 5), vec3_new(0, 0, 0));
+        }
+        return;
+    }
+
     load_mesh("assets/runway.obj", "assets/runway.png", vec3_new(1, 1, 1), vec3_new(0, -1.5, 23), vec3_new(0, 0, 0));
     load_mesh("assets/f22.obj", "assets/f22.png", vec3_new(1, 1, 1), vec3_new(0, -1.3, 5), vec3_new(0, -M_PI/2, 0));
     load_mesh("assets/efa.obj", "assets/efa.png", vec3_new(1, 1, 1), vec3_new(-2, -1.3, 9), vec3_new(0, -M_PI/2, 0));
@@ -86,6 +161,19 @@ void process_input(void) {
                     case SDLK_x:
                         set_cull_method(CULL_NONE);
                         break;
+                    case SDLK_p:
+                        should_print_stats = !should_print_stats;
+                        set_texture_stats_enabled(should_print_stats);
+                        break;
+                    case SDLK_m:
+                        toggle_mipmapping();
+                        break;
+                    case SDLK_o:
+                        should_sort_triangles = !should_sort_triangles;
+                        break;
+                    case SDLK_z:
+                        set_depth_format((get_depth_format() + 1) % NUM_DEPTH_FORMATS);
+                        break;
                     case SDLK_1:
                         set_render_method(RENDER_WIRE_VERTEX);
                         break;
@@ -104,12 +192,54 @@ void process_input(void) {
                     case SDLK_6:
                         set_render_method(RENDER_TEXTURED_WIRE);
                         break;
+                    case SDLK_7:
+                        set_render_method(RENDER_VISIBILITY_BUFFER);
+                        break;
                 }
                 break;
         }
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Parallel geometry
+///////////////////////////////////////////////////////////////////////////////
+// The per-vertex stages are a few batch transforms per mesh and run on the
+// main thread. Each mesh's faces are then cut into chunks of FACES_PER_CHUNK
+// and the chunks are shared out over the geometry thread pool. A chunk writes
+// its triangles and clipping counts into its own buffer, and the buffers are
+// appended to the frame's triangles in chunk order afterwards, so the triangle
+// list comes out the same whichever thread ran which chunk and however many
+// threads there are.
+///////////////////////////////////////////////////////////////////////////////
+#define FACES_PER_CHUNK 512
+
+typedef struct {
+    const mesh_t* mesh;
+    int first_face;
+    int end_face;
+    triangle_setup_t* triangles; // grown as needed and kept from frame to frame
+    int num_triangles;
+    int triangles_capacity;
+    clip_stats_t clip_stats;
+} face_chunk_t;
+
+face_chunk_t* face_chunks = NULL;
+int num_face_chunks = 0;
+int face_chunks_capacity = 0;
+
+// the geometry lists only ever grow, and a frame can't go on without the
+// triangles it has lost, so running out of memory ends the program rather
+// than leaving the old buffer behind a NULL pointer
+static void* grow_allocation(void* allocation, size_t size, const char* name) {
+    void* grown = realloc(allocation, size);
+    if (grown == NULL) {
+        fprintf(stderr, "Error growing the %s to %zu bytes.\n", name, size);
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Process the graphics pipeline stages for all the mesh triangles
 ///////////////////////////////////////////////////////////////////////////////
@@ -117,13 +247,13 @@ void process_input(void) {
 // | Model space |  <-- original mesh vertices
 // +-------------+
 // |   +-------------+
-// `-> | World space |  <-- multiply by world matrix
+// `-> | World space |  <-- world matrix, cached premultiplied by the view matrix
 //     +-------------+
 //     |   +--------------+
-//     `-> | Camera space |  <-- multiply by view matrix
+//     `-> | Camera space |  <-- one world-view multiply per shared vertex
 //         +--------------+
 //         |    +------------+
-//         `--> |  Clipping  |  <-- clip against the six frustum planes
+//         `--> |  Clipping  |  <-- clip against near, far and the guard band
 //              +------------+
 //              |    +------------+
 //              `--> | Projection |  <-- multiply by projection matrix
@@ -135,72 +265,105 @@ void process_input(void) {
 //                        `--> | Screen space |  <-- ready to render
 //                             +--------------+
 ///////////////////////////////////////////////////////////////////////////////
-void process_graphics_pipeline_stages(mesh_t* mesh) {
-    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
-
-    vec3_t up_direction = { 0, 1, 0 };
-    vec3_t target = get_camera_lookat_target();
-    mat4_t view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-    // order matters: scale -> rotate -> translate
-    mat4_t world_matrix = mat4_identity();
-    world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-    world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-    world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-    world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-    world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-    for (int i = 0; i < array_length(mesh->faces); ++i) {
-        face_t mesh_face = mesh->faces[i];
+// the per-vertex stages for a whole mesh; returns false if the mesh is culled
+bool transform_mesh_vertices(mesh_t* mesh, const mat4_t* view_matrix, int view_version) {
+    // skip the whole mesh when its bounds can't be seen
+    update_mesh_transforms(mesh, view_matrix, view_version);
+    if (is_mesh_outside_frustum(mesh)) {
+        return false;
+    }
 
-        vec3_t face_vertices[3];
-        face_vertices[0] = mesh->vertices[mesh_face.a];
-        face_vertices[1] = mesh->vertices[mesh_face.b];
-        face_vertices[2] = mesh->vertices[mesh_face.c];
+    // transform each vertex once to view space, the faces sharing it pick it
+    // up by index
+    mat4_mul_vec4_streams(&mesh->world_view_matrix, &mesh->vertices, &mesh->view_vertices, mesh->num_vertices);
 
-        // transform
-        vec4_t transformed_vertices[3];
-        for (int j = 0; j < 3; ++j) {
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-            transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+    // and to clip space, for faces that don't need clipping
+    mat4_mul_vec4_streams(&proj_matrix, &mesh->view_vertices, &mesh->clip_vertices, mesh->num_vertices);
 
-            // transform to view space
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
+    for (int i = 0; i < mesh->num_vertices; ++i) {
+        mesh->vertex_outcodes[i] = get_outcode(vec3_from_vec4(vec4_from_streams(&mesh->view_vertices, i)));
+    }
+    return true;
+}
 
-            transformed_vertices[j] = transformed_vertex;
-        }
+static void push_chunk_triangle(face_chunk_t* chunk, const triangle_t* triangle) {
+    if (chunk->num_triangles == chunk->triangles_capacity) {
+        chunk->triangles_capacity = chunk->triangles_capacity > 0 ? chunk->triangles_capacity * 2 : FACES_PER_CHUNK;
+        chunk->triangles = grow_allocation(chunk->triangles, sizeof(triangle_setup_t) * chunk->triangles_capacity, "chunk triangle list");
+    }
+    setup_triangle(&chunk->triangles[chunk->num_triangles++], triangle);
+}
 
-        vec3_t face_normal = get_triangle_normal(transformed_vertices);
+// the per-face stages for a chunk of a mesh's faces
+void process_graphics_pipeline_stages(face_chunk_t* chunk) {
+    const mesh_t* mesh = chunk->mesh;
+    clip_stats_t* clip_stats = &chunk->clip_stats;
+    chunk->num_triangles = 0;
+    *clip_stats = (clip_stats_t) { 0 };
 
-        if (is_cull_backface()) {
-            // find vector from triangle to the origin
-            vec3_t camera_ray = vec3_sub(vec3_new(0, 0, 0), vec3_from_vec4(transformed_vertices[0]));
+    for (int i = chunk->first_face; i < chunk->end_face; ++i) {
+        face_t mesh_face = mesh->faces[i];
 
-            float dot_normal_camera = vec3_dot(face_normal, camera_ray);
-            if (dot_normal_camera < 0) {
+        // the eye behind the face's plane sees its back
+        if (is_cull_backface()) {
+            float eye_distance = vec3_dot(mesh_face.normal, mesh->object_eye_position) - mesh_face.distance;
+            if (eye_distance < 0) {
                 continue;
             }
         }
 
-        // clipping
-        polygon_t polygon = create_polygon_from_triangle(
-            vec3_from_vec4(transformed_vertices[0]),
-            vec3_from_vec4(transformed_vertices[1]),
-            vec3_from_vec4(transformed_vertices[2]),
-            mesh_face.a_uv,
-            mesh_face.b_uv,
-            mesh_face.c_uv
-        );
-        clip_polygon(&polygon);
-
-        // break polygon back into triangles
+        vec4_t transformed_vertices[3];
+        transformed_vertices[0] = vec4_from_streams(&mesh->view_vertices, mesh_face.a);
+        transformed_vertices[1] = vec4_from_streams(&mesh->view_vertices, mesh_face.b);
+        transformed_vertices[2] = vec4_from_streams(&mesh->view_vertices, mesh_face.c);
+
+        // clipping, skipped for faces wholly inside or wholly outside
+        uint16_t outcodes[3] = {
+            mesh->vertex_outcodes[mesh_face.a],
+            mesh->vertex_outcodes[mesh_face.b],
+            mesh->vertex_outcodes[mesh_face.c]
+        };
+
+        // triangles in clip space
         triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
         int num_triangles_after_clipping = 0;
-        triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+        if ((outcodes[0] & outcodes[1] & outcodes[2]) != 0) {
+            ++clip_stats->trivially_rejected;
+            continue;
+        } else if (((outcodes[0] | outcodes[1] | outcodes[2]) & CLIP_OUTCODE_MASK) == 0) {
+            ++clip_stats->trivially_accepted;
+            triangles_after_clipping[0] = (triangle_t) {
+                .points = {
+                    vec4_from_streams(&mesh->clip_vertices, mesh_face.a),
+                    vec4_from_streams(&mesh->clip_vertices, mesh_face.b),
+                    vec4_from_streams(&mesh->clip_vertices, mesh_face.c)
+                },
+                .texcoords = { mesh_face.a_uv, mesh_face.b_uv, mesh_face.c_uv }
+            };
+            num_triangles_after_clipping = 1;
+        } else {
+            ++clip_stats->clipped;
+            polygon_t polygon = create_polygon_from_triangle(
+                vec3_from_vec4(transformed_vertices[0]),
+                vec3_from_vec4(transformed_vertices[1]),
+                vec3_from_vec4(transformed_vertices[2]),
+                mesh_face.a_uv,
+                mesh_face.b_uv,
+                mesh_face.c_uv
+            );
+            clip_polygon(&polygon);
+
+            // break polygon back into triangles
+            triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+            for (int t = 0; t < num_triangles_after_clipping; ++t) {
+                for (int j = 0; j < 3; ++j) {
+                    triangles_after_clipping[t].points[j] = mat4_mul_vec4(proj_matrix, triangles_after_clipping[t].points[j]);
+                }
+            }
+        }
+
+        // the object space normal turned into view space, where the light is
+        vec3_t face_normal = mat4_mul_vec3_direction(mesh->normal_matrix, mesh_face.normal);
 
         for (int t = 0; t < num_triangles_after_clipping; ++t) {
             triangle_t triangle_after_clipping = triangles_after_clipping[t];
@@ -208,7 +371,7 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
             // project into screen space
             vec4_t projected_points[3];
             for (int j = 0; j < 3; ++j) {
-                projected_points[j] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[j]);
+                projected_points[j] = vec4_perspective_divide(triangle_after_clipping.points[j]);
 
                 // scale to viewport
                 projected_points[j].x *= (get_window_width() / 2.0);
@@ -241,25 +404,182 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
                 .texture = mesh->texture
             };
 
-            if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH) {
-                triangles_to_render[num_triangles_to_render++] = triangle_to_render;
+            push_chunk_triangle(chunk, &triangle_to_render);
+        }
+    }
+}
+
+static void process_face_chunk(int chunk_index, int thread_index, void* data) {
+    process_graphics_pipeline_stages(&face_chunks[chunk_index]);
+}
+
+void add_face_chunks(const mesh_t* mesh) {
+    int num_faces = array_length(mesh->faces);
+    for (int first_face = 0; first_face < num_faces; first_face += FACES_PER_CHUNK) {
+        if (num_face_chunks == face_chunks_capacity) {
+            int capacity = face_chunks_capacity > 0 ? face_chunks_capacity * 2 : 16;
+            face_chunks = grow_allocation(face_chunks, sizeof(face_chunk_t) * capacity, "face chunk list");
+            for (int i = face_chunks_capacity; i < capacity; ++i) {
+                face_chunks[i] = (face_chunk_t) { 0 };
             }
+            face_chunks_capacity = capacity;
         }
+
+        face_chunk_t* chunk = &face_chunks[num_face_chunks++];
+        chunk->mesh = mesh;
+        chunk->first_face = first_face;
+        chunk->end_face = first_face + FACES_PER_CHUNK < num_faces ? first_face + FACES_PER_CHUNK : num_faces;
     }
 }
 
-void update(void) {
-    int time_to_wait =  FRAME_TARGET_TIME - SDL_GetTicks() - previous_frame_time;
-    if (time_to_wait > 0 && time_to_wait <= FRAME_TARGET_TIME) {
-        SDL_Delay(time_to_wait);
+// a triangle list big enough for num_triangles. Lists are kept from frame to
+// frame and only grow, so once the scene's largest frame has been seen no
+// frame allocates
+static void reserve_triangles(triangle_setup_t** triangles, int* capacity, int num_triangles) {
+    if (num_triangles <= *capacity) {
+        return;
     }
-    delta_time = (SDL_GetTicks() - previous_frame_time) / 1000.0;
-    previous_frame_time = SDL_GetTicks();
+    int new_capacity = *capacity > 0 ? *capacity : FACES_PER_CHUNK;
+    while (new_capacity < num_triangles) {
+        new_capacity *= 2;
+    }
+    *triangles = grow_allocation(*triangles, sizeof(triangle_setup_t) * new_capacity, "triangle list");
+    *capacity = new_capacity;
+    ++num_triangle_list_grows;
+}
+
+void process_face_chunks(frame_geometry_t* frame) {
+    if (geometry_thread_pool != NULL) {
+        run_thread_pool_jobs(geometry_thread_pool, num_face_chunks, process_face_chunk, NULL);
+    } else {
+        for (int i = 0; i < num_face_chunks; ++i) {
+            process_graphics_pipeline_stages(&face_chunks[i]);
+        }
+    }
+
+    int num_triangles = 0;
+    for (int i = 0; i < num_face_chunks; ++i) {
+        num_triangles += face_chunks[i].num_triangles;
+    }
+    reserve_triangles(&frame->triangles_to_render, &frame->triangles_capacity, num_triangles);
 
-    num_triangles_to_render = 0;
+    for (int i = 0; i < num_face_chunks; ++i) {
+        const face_chunk_t* chunk = &face_chunks[i];
+        memcpy(&frame->triangles_to_render[frame->num_triangles_to_render], chunk->triangles, sizeof(triangle_setup_t) * chunk->num_triangles);
+        frame->num_triangles_to_render += chunk->num_triangles;
 
-    for (int mesh_index = 0; mesh_index < get_num_meshes(); ++mesh_index) {
-        mesh_t* mesh = get_mesh(mesh_index);
+        frame->clip_stats.trivially_accepted += chunk->clip_stats.trivially_accepted;
+        frame->clip_stats.trivially_rejected += chunk->clip_stats.trivially_rejected;
+        frame->clip_stats.clipped += chunk->clip_stats.clipped;
+    }
+}
+
+void free_face_chunks(void) {
+    for (int i = 0; i < face_chunks_capacity; ++i) {
+        free(face_chunks[i].triangles);
+    }
+    free(face_chunks);
+    face_chunks = NULL;
+    num_face_chunks = 0;
+    face_chunks_capacity = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Front to back ordering
+///////////////////////////////////////////////////////////////////////////////
+// Drawing near triangles first lets the depth test and the hi-z buffer throw
+// away the far ones behind them before they are shaded. Meshes are processed
+// nearest first, then the triangles are bucketed on the view depth of their
+// nearest vertex. The bucket sort is stable, so triangles in the same bucket
+// keep the mesh order. Nothing is blended and the wireframe and vertex
+// overlays are drawn in passes of their own after the surfaces, so the order
+// only changes the work done, not the image.
+///////////////////////////////////////////////////////////////////////////////
+
+// the bits of a positive float increase with its value, so the exponent and
+// top mantissa bits give buckets an eighth of a doubling in distance wide
+#define DEPTH_BUCKET_SHIFT 20
+#define NUM_DEPTH_BUCKETS (1 << (31 - DEPTH_BUCKET_SHIFT))
+
+int depth_bucket_counts[NUM_DEPTH_BUCKETS + 1];
+
+// nearest first, or load order while sorting is switched off
+void order_meshes_by_distance(vec3_t camera_position, int* mesh_order) {
+    float distances[MAX_NUM_MESHES];
+
+    for (int i = 0; i < get_num_meshes(); ++i) {
+        vec3_t to_mesh = vec3_sub(get_mesh(i)->translation, camera_position);
+        distances[i] = vec3_dot(to_mesh, to_mesh);
+        mesh_order[i] = i;
+    }
+
+    if (!should_sort_triangles) {
+        return;
+    }
+
+    for (int i = 1; i < get_num_meshes(); ++i) {
+        int mesh_index = mesh_order[i];
+        int j = i;
+        for (; j > 0 && distances[mesh_order[j - 1]] > distances[mesh_index]; --j) {
+            mesh_order[j] = mesh_order[j - 1];
+        }
+        mesh_order[j] = mesh_index;
+    }
+}
+
+int get_depth_bucket(const triangle_setup_t* triangle) {
+    float nearest_recipricol_w = triangle->recipricol_w[0];
+    if (triangle->recipricol_w[1] > nearest_recipricol_w) nearest_recipricol_w = triangle->recipricol_w[1];
+    if (triangle->recipricol_w[2] > nearest_recipricol_w) nearest_recipricol_w = triangle->recipricol_w[2];
+
+    // clipping keeps w in front of the near plane, so it is always positive
+    float nearest_w = 1.0f / nearest_recipricol_w;
+    uint32_t bits;
+    memcpy(&bits, &nearest_w, sizeof(bits));
+    return bits >> DEPTH_BUCKET_SHIFT;
+}
+
+void sort_triangles_front_to_back(frame_geometry_t* frame) {
+    triangle_setup_t* triangles_to_render = frame->triangles_to_render;
+    int num_triangles_to_render = frame->num_triangles_to_render;
+
+    for (int i = 0; i <= NUM_DEPTH_BUCKETS; ++i) {
+        depth_bucket_counts[i] = 0;
+    }
+    for (int i = 0; i < num_triangles_to_render; ++i) {
+        ++depth_bucket_counts[get_depth_bucket(&triangles_to_render[i]) + 1];
+    }
+    for (int i = 0; i < NUM_DEPTH_BUCKETS; ++i) {
+        depth_bucket_counts[i + 1] += depth_bucket_counts[i];
+    }
+
+    reserve_triangles(&sorted_triangles, &sorted_triangles_capacity, num_triangles_to_render);
+    for (int i = 0; i < num_triangles_to_render; ++i) {
+        int bucket = get_depth_bucket(&triangles_to_render[i]);
+        sorted_triangles[depth_bucket_counts[bucket]++] = triangles_to_render[i];
+    }
+
+    // the sorted list becomes the frame's, and the old one is sorted into next
+    frame->triangles_to_render = sorted_triangles;
+    sorted_triangles = triangles_to_render;
+
+    int capacity = frame->triangles_capacity;
+    frame->triangles_capacity = sorted_triangles_capacity;
+    sorted_triangles_capacity = capacity;
+}
+
+// everything from the camera snapshot to the sorted triangle list; runs on the
+// geometry thread when frames are pipelined
+void build_frame_geometry(frame_geometry_t* frame) {
+    frame->num_triangles_to_render = 0;
+    frame->clip_stats = (clip_stats_t) { 0 };
+
+    int mesh_order[MAX_NUM_MESHES];
+    order_meshes_by_distance(frame->camera_position, mesh_order);
+
+    num_face_chunks = 0;
+    for (int i = 0; i < get_num_meshes(); ++i) {
+        mesh_t* mesh = get_mesh(mesh_order[i]);
 
         // mesh->rotation.x += 0.05 * delta_time;
         // mesh->rotation.y += 0.5 * delta_time;
@@ -269,62 +589,199 @@ void update(void) {
         // mesh->translation.x += 0.01 * delta_time;
         // mesh->translation.z = 5.0;
 
-        process_graphics_pipeline_stages(mesh);
+        if (!transform_mesh_vertices(mesh, &frame->view_matrix, frame->view_version)) {
+            ++frame->clip_stats.culled_meshes;
+            continue;
+        }
+        add_face_chunks(mesh);
+    }
+    process_face_chunks(frame);
+
+    if (should_sort_triangles) {
+        sort_triangles_front_to_back(frame);
     }
+    frame->num_triangle_list_grows = num_triangle_list_grows;
 }
 
-void render(void) {
-    clear_colour_buffer(0xFF000000);
-    clear_z_buffer();
+///////////////////////////////////////////////////////////////////////////////
+// Pipelined frames
+///////////////////////////////////////////////////////////////////////////////
+// With --pipeline the geometry for frame N + 1 is built on a thread of its own
+// while the main thread rasterizes frame N. The two frame_geometry_t buffers
+// swap over once both are done, so the image on screen is at most one frame
+// behind the input. The camera is copied into the frame before the geometry
+// thread starts, and input is only handled while that thread is idle, so the
+// two never read and write the same state at once. The first frame shows an
+// empty list.
+///////////////////////////////////////////////////////////////////////////////
+static int run_geometry_thread(void* data) {
+    while (true) {
+        SDL_SemWait(geometry_start_semaphore);
+        if (should_stop_geometry_thread) {
+            break;
+        }
+        build_frame_geometry(geometry_frame);
+        SDL_SemPost(geometry_done_semaphore);
+    }
+    return 0;
+}
 
-    draw_grid();
+void start_geometry_thread(void) {
+    geometry_start_semaphore = SDL_CreateSemaphore(0);
+    geometry_done_semaphore = SDL_CreateSemaphore(0);
+    geometry_thread = SDL_CreateThread(run_geometry_thread, "geometry", NULL);
 
-    for (int i = 0; i < num_triangles_to_render; ++i) {
-        triangle_t triangle = triangles_to_render[i];
-
-        if (should_render_filled_triangles()) {
-            draw_filled_triangle(
-                triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w,
-                triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w,
-                triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w,
-                triangle.colour);
-        }
+    geometry_frame = &frame_geometry[1];
+    render_frame = &frame_geometry[0];
+}
 
-        if (should_render_textured_triangles()) {
-            draw_textured_triangle(
-                triangle.points[0].x, triangle.points[0].y, triangle.points[0].z, triangle.points[0].w, triangle.texcoords[0].u, triangle.texcoords[0].v,
-                triangle.points[1].x, triangle.points[1].y, triangle.points[1].z, triangle.points[1].w, triangle.texcoords[1].u, triangle.texcoords[1].v,
-                triangle.points[2].x, triangle.points[2].y, triangle.points[2].z, triangle.points[2].w, triangle.texcoords[2].u, triangle.texcoords[2].v,
-                triangle.texture);
-        }
+// waits for the frame being built and hands it to the rasterizer
+void finish_pipelined_frame(void) {
+    SDL_SemWait(geometry_done_semaphore);
 
-        if (should_render_wireframe()) {
-            draw_triangle(
-                triangle.points[0].x, triangle.points[0].y,
-                triangle.points[1].x, triangle.points[1].y,
-                triangle.points[2].x, triangle.points[2].y,
-                0xFFFFFFFF);
-        }
+    frame_geometry_t* built_frame = geometry_frame;
+    geometry_frame = render_frame;
+    render_frame = built_frame;
+}
+
+void stop_geometry_thread(void) {
+    if (geometry_thread == NULL) {
+        return;
+    }
+    should_stop_geometry_thread = true;
+    SDL_SemPost(geometry_start_semaphore);
+    SDL_WaitThread(geometry_thread, NULL);
+    SDL_DestroySemaphore(geometry_start_semaphore);
+    SDL_DestroySemaphore(geometry_done_semaphore);
+    geometry_thread = NULL;
+}
+
+void update(void) {
+    int time_to_wait =  FRAME_TARGET_TIME - SDL_GetTicks() - previous_frame_time;
+    if (time_to_wait > 0 && time_to_wait <= FRAME_TARGET_TIME) {
+        SDL_Delay(time_to_wait);
+    }
+    delta_time = (SDL_GetTicks() - previous_frame_time) / 1000.0;
+    previous_frame_time = SDL_GetTicks();
+
+    // the same view for every mesh, only rebuilt after the camera moves
+    geometry_frame->camera_position = get_camera_position();
+    geometry_frame->view_matrix = *get_camera_view_matrix();
+    geometry_frame->view_version = get_camera_view_version();
+
+    if (geometry_thread != NULL) {
+        SDL_SemPost(geometry_start_semaphore);
+    } else {
+        build_frame_geometry(geometry_frame);
+    }
+}
+
+void print_stats(void) {
+    // once a second is plenty to read
+    if (SDL_GetTicks() - previous_stats_time < 1000) {
+        return;
+    }
+    previous_stats_time = SDL_GetTicks();
+
+    // overdraw is how many times each covered pixel was rasterized
+    int num_covered_pixels = count_covered_pixels();
+    float overdraw = num_covered_pixels > 0 ? (float) frame_stats.pixels_tested / num_covered_pixels : 0;
+
+    printf("meshes culled: %d, faces accepted: %d, rejected: %d, clipped: %d\n",
+        render_frame->clip_stats.culled_meshes,
+        render_frame->clip_stats.trivially_accepted,
+        render_frame->clip_stats.trivially_rejected,
+        render_frame->clip_stats.clipped);
+    printf("triangles: %d, list grows: %d, pixels tested: %llu, written: %llu, hi-z rejected: %llu, overdraw: %.3f, texture kb: %llu, depth: %s\n",
+        render_frame->num_triangles_to_render,
+        render_frame->num_triangle_list_grows,
+        (unsigned long long) frame_stats.pixels_tested,
+        (unsigned long long) frame_stats.pixels_written,
+        (unsigned long long) frame_stats.hi_z_rejected_pixels,
+        overdraw,
+        (unsigned long long) frame_stats.texture_bytes_touched / 1024,
+        depth_format_names[get_depth_format()]);
+}
+
+void render(void) {
+    const triangle_setup_t* triangles_to_render = render_frame->triangles_to_render;
+    int num_triangles_to_render = render_frame->num_triangles_to_render;
+    frame_stats = (raster_stats_t) { 0 };
+
+    // the kernels for this frame's render method and depth format
+    select_raster_kernels();
 
-        if (should_render_wire_vertex()) {
-            draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6, 0xFFFF0000);
-            draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6, 0xFFFF0000);
-            draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6, 0xFFFF0000);
+    if (get_num_render_threads() > 1) {
+        render_tiles(triangles_to_render, num_triangles_to_render, 0xFF000000, 0xFF333333, &frame_stats);
+    } else {
+        clear_colour_buffer(0xFF000000, 0xFF333333, NULL);
+        clear_z_buffer(NULL);
+
+        draw_triangles(triangles_to_render, num_triangles_to_render, NULL, &frame_stats);
+
+        if (should_render_visibility_buffer()) {
+            resolve_visibility_buffer(triangles_to_render, NULL, &frame_stats);
         }
     }
 
     render_colour_buffer();
+
+    if (should_print_stats) {
+        print_stats();
+    }
+
+    if (geometry_thread != NULL) {
+        finish_pipelined_frame();
+    }
 }
 
 void free_resources(void) {
+    stop_geometry_thread();
+    destroy_thread_pool(geometry_thread_pool);
+    free_face_chunks();
+    for (int i = 0; i < 2; ++i) {
+        free(frame_geometry[i].triangles_to_render);
+    }
+    free(sorted_triangles);
+    destroy_tile_renderer();
     free_meshes();
     destroy_window();
 }
 
-int main(void) {
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_render_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            // --mesh crab loads assets/crab.obj and assets/crab.png in place of the runway scene
+            if (num_command_line_meshes < MAX_COMMAND_LINE_MESHES) {
+                command_line_meshes[num_command_line_meshes++] = argv[i + 1];
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            // --depth unorm16 picks the z buffer format by name
+            ++i;
+            for (int format = 0; format < NUM_DEPTH_FORMATS; ++format) {
+                if (strcmp(argv[i], depth_format_names[format]) == 0) {
+                    depth_format = format;
+                }
+            }
+        } else if (strcmp(argv[i], "--guard-band") == 0 && i + 1 < argc) {
+            // --guard-band 1 clips to the screen edges, larger values leave
+            // more of the side clipping to the rasterizer's scissor
+            set_guard_band_extent(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            // --pipeline builds the next frame's geometry while this one is drawn
+            is_pipelined = true;
+        }
+    }
+
     is_running = initialise_window();
 
     setup();
+    if (is_pipelined) {
+        start_geometry_thread();
+    }
 
     while (is_running) {
         process_input();
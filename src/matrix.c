@@ -1,6 +1,13 @@
 #include <math.h>
+#include <stddef.h>
+#include <SDL.h>
 #include "matrix.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_X86_SIMD
+#include <immintrin.h>
+#endif
+
 mat4_t mat4_identity(void) {
     mat4_t m = {{
         {1, 0, 0 ,0},
@@ -100,16 +107,36 @@ mat4_t mat4_mul_mat4(mat4_t a, mat4_t b) {
     return m;
 }
 
+mat4_t mat4_transpose(mat4_t m) {
+    mat4_t result;
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            result.m[i][j] = m.m[j][i];
+        }
+    }
+    return result;
+}
+
+// a direction has no position, so only the upper 3x3 applies
+vec3_t mat4_mul_vec3_direction(mat4_t m, vec3_t v) {
+    vec3_t result;
+    result.x = m.m[0][0] * v.x + m.m[0][1] * v.y + m.m[0][2] * v.z;
+    result.y = m.m[1][0] * v.x + m.m[1][1] * v.y + m.m[1][2] * v.z;
+    result.z = m.m[2][0] * v.x + m.m[2][1] * v.y + m.m[2][2] * v.z;
+    return result;
+}
+
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v) {
-    vec4_t result = mat4_mul_vec4(mat_proj, v);
+    return vec4_perspective_divide(mat4_mul_vec4(mat_proj, v));
+}
 
-    // perspective divide
-    if (result.w != 0.0) {
-        result.x /= result.w;
-        result.y /= result.w;
-        result.z /= result.w;
+vec4_t vec4_perspective_divide(vec4_t v) {
+    if (v.w != 0.0) {
+        v.x /= v.w;
+        v.y /= v.w;
+        v.z /= v.w;
     }
-    return result;
+    return v;
 }
 
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
@@ -127,3 +154,110 @@ mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up) {
     }};
     return view_matrix;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch transforms
+///////////////////////////////////////////////////////////////////////////////
+// mat4_mul_vec4_streams() transforms a whole array of points stored as
+// structure of arrays. Each matrix element is broadcast across a register
+// once, then 4 (SSE2) or 8 (AVX) points go through every row at a time.
+// Every lane does the same multiplies and adds in the same order as
+// mat4_mul_vec4, so the results match it bit for bit. Input points have an
+// implicit w of 1 and no w is written when result->w is NULL. Each point is
+// read before it is written, so the result may be the input streams.
+///////////////////////////////////////////////////////////////////////////////
+
+// transforms the points from first on, returning how many were done
+typedef int (*batch_transform_t)(const mat4_t* m, const vec4_streams_t* points, const vec4_streams_t* result, int first, int count);
+
+static int mul_vec4_streams_scalar(const mat4_t* m, const vec4_streams_t* points, const vec4_streams_t* result, int first, int count) {
+    for (int i = first; i < count; ++i) {
+        float x = points->x[i];
+        float y = points->y[i];
+        float z = points->z[i];
+        result->x[i] = m->m[0][0] * x + m->m[0][1] * y + m->m[0][2] * z + m->m[0][3];
+        result->y[i] = m->m[1][0] * x + m->m[1][1] * y + m->m[1][2] * z + m->m[1][3];
+        result->z[i] = m->m[2][0] * x + m->m[2][1] * y + m->m[2][2] * z + m->m[2][3];
+        if (result->w != NULL) {
+            result->w[i] = m->m[3][0] * x + m->m[3][1] * y + m->m[3][2] * z + m->m[3][3];
+        }
+    }
+    return count - first;
+}
+
+#ifdef MATRIX_X86_SIMD
+__attribute__((target("sse2")))
+static int mul_vec4_streams_sse2(const mat4_t* m, const vec4_streams_t* points, const vec4_streams_t* result, int first, int count) {
+    float* outputs[4] = { result->x, result->y, result->z, result->w };
+    int num_rows = result->w != NULL ? 4 : 3;
+
+    __m128 elements[4][4];
+    for (int row = 0; row < 4; ++row) {
+        for (int column = 0; column < 4; ++column) {
+            elements[row][column] = _mm_set1_ps(m->m[row][column]);
+        }
+    }
+
+    int i = first;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(points->x + i);
+        __m128 y = _mm_loadu_ps(points->y + i);
+        __m128 z = _mm_loadu_ps(points->z + i);
+        for (int row = 0; row < num_rows; ++row) {
+            __m128 value = _mm_mul_ps(elements[row][0], x);
+            value = _mm_add_ps(value, _mm_mul_ps(elements[row][1], y));
+            value = _mm_add_ps(value, _mm_mul_ps(elements[row][2], z));
+            value = _mm_add_ps(value, elements[row][3]);
+            _mm_storeu_ps(outputs[row] + i, value);
+        }
+    }
+    return i - first;
+}
+
+__attribute__((target("avx")))
+static int mul_vec4_streams_avx(const mat4_t* m, const vec4_streams_t* points, const vec4_streams_t* result, int first, int count) {
+    float* outputs[4] = { result->x, result->y, result->z, result->w };
+    int num_rows = result->w != NULL ? 4 : 3;
+
+    __m256 elements[4][4];
+    for (int row = 0; row < 4; ++row) {
+        for (int column = 0; column < 4; ++column) {
+            elements[row][column] = _mm256_set1_ps(m->m[row][column]);
+        }
+    }
+
+    int i = first;
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(points->x + i);
+        __m256 y = _mm256_loadu_ps(points->y + i);
+        __m256 z = _mm256_loadu_ps(points->z + i);
+        for (int row = 0; row < num_rows; ++row) {
+            __m256 value = _mm256_mul_ps(elements[row][0], x);
+            value = _mm256_add_ps(value, _mm256_mul_ps(elements[row][1], y));
+            value = _mm256_add_ps(value, _mm256_mul_ps(elements[row][2], z));
+            value = _mm256_add_ps(value, elements[row][3]);
+            _mm256_storeu_ps(outputs[row] + i, value);
+        }
+    }
+    return i - first;
+}
+#endif
+
+static batch_transform_t batch_transform = mul_vec4_streams_scalar;
+
+void initialise_batch_transforms(void) {
+#ifdef MATRIX_X86_SIMD
+    if (SDL_HasAVX()) {
+        batch_transform = mul_vec4_streams_avx;
+    } else if (SDL_HasSSE2()) {
+        batch_transform = mul_vec4_streams_sse2;
+    }
+#endif
+}
+
+void mat4_mul_vec4_streams(const mat4_t* m, const vec4_streams_t* points, const vec4_streams_t* result, int count) {
+    int num_done = batch_transform(m, points, result, 0, count);
+
+    // the points left over after the last full register
+    mul_vec4_streams_scalar(m, points, result, num_done, count);
+}
@@ -7,6 +7,8 @@ typedef struct {
     float m[4][4];
 } mat4_t;
 
+void initialise_batch_transforms(void);
+
 mat4_t mat4_identity(void);
 mat4_t mat4_make_scale(float sx, float sy, float sz);
 mat4_t mat4_make_translation(float tx, float ty, float tz);
@@ -16,7 +18,11 @@ mat4_t mat4_make_rotation_z(float angle);
 mat4_t mat4_make_perspective(float fov, float aspect, float znear, float zfar);
 vec4_t mat4_mul_vec4(mat4_t m, vec4_t v);
 mat4_t mat4_mul_mat4(mat4_t a, mat4_t b);
+mat4_t mat4_transpose(mat4_t m);
+vec3_t mat4_mul_vec3_direction(mat4_t m, vec3_t v);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
+vec4_t vec4_perspective_divide(vec4_t v);
+void mat4_mul_vec4_streams(const mat4_t* m, const vec4_streams_t* points, const vec4_streams_t* result, int count);
 mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
 
 #endif
@@ -1,15 +1,79 @@
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "array.h"
+#include "clipping.h"
 #include "mesh.h"
 #include "upng.h"
 
-#define MAX_NUM_MESHES 10
+// every mesh owns a texture and needs a handle for it; fails to compile if
+// the texture table can't hold one per mesh
+typedef char texture_handle_per_mesh[(MAX_NUM_MESHES < MAX_NUM_TEXTURES) ? 1 : -1];
+
 static mesh_t meshes[MAX_NUM_MESHES];
 static int mesh_count = 0;
 
+static vec4_streams_t allocate_streams(int count, bool has_w) {
+    vec4_streams_t streams = {
+        .x = malloc(sizeof(float) * count),
+        .y = malloc(sizeof(float) * count),
+        .z = malloc(sizeof(float) * count),
+        .w = has_w ? malloc(sizeof(float) * count) : NULL
+    };
+    return streams;
+}
+
+static void free_streams(vec4_streams_t* streams) {
+    free(streams->x);
+    free(streams->y);
+    free(streams->z);
+    free(streams->w);
+}
+
+// the unit normal of each face and its distance from the origin along it,
+// in object space, so the faces' planes never need rebuilding
+static void compute_face_planes(mesh_t* mesh, const vec3_t* positions) {
+    for (int i = 0; i < array_length(mesh->faces); ++i) {
+        face_t* face = &mesh->faces[i];
+        vec4_t vertices[3] = {
+            vec4_from_vec3(positions[face->a]),
+            vec4_from_vec3(positions[face->b]),
+            vec4_from_vec3(positions[face->c])
+        };
+        face->normal = get_triangle_normal(vertices);
+        face->distance = vec3_dot(face->normal, positions[face->a]);
+    }
+}
+
+// the box around the vertices, and a sphere around the box's centre that
+// reaches the farthest vertex
+static void compute_mesh_bounds(mesh_t* mesh, const vec3_t* positions) {
+    int num_positions = array_length((void*) positions);
+    if (num_positions == 0) {
+        return;
+    }
+
+    mesh->bounds_min = positions[0];
+    mesh->bounds_max = positions[0];
+    for (int i = 1; i < num_positions; ++i) {
+        mesh->bounds_min.x = fminf(mesh->bounds_min.x, positions[i].x);
+        mesh->bounds_min.y = fminf(mesh->bounds_min.y, positions[i].y);
+        mesh->bounds_min.z = fminf(mesh->bounds_min.z, positions[i].z);
+        mesh->bounds_max.x = fmaxf(mesh->bounds_max.x, positions[i].x);
+        mesh->bounds_max.y = fmaxf(mesh->bounds_max.y, positions[i].y);
+        mesh->bounds_max.z = fmaxf(mesh->bounds_max.z, positions[i].z);
+    }
+
+    mesh->bounds_centre = vec3_mul(vec3_add(mesh->bounds_min, mesh->bounds_max), 0.5f);
+    mesh->bounds_radius = 0;
+    for (int i = 0; i < num_positions; ++i) {
+        mesh->bounds_radius = fmaxf(mesh->bounds_radius, vec3_length(vec3_sub(positions[i], mesh->bounds_centre)));
+    }
+}
+
 bool load_mesh_obj_data(mesh_t* mesh, char* obj_filename) {
     FILE* fp = fopen(obj_filename, "r");
     if (fp == NULL) {
@@ -18,13 +82,14 @@ bool load_mesh_obj_data(mesh_t* mesh, char* obj_filename) {
 
     ssize_t read;
     char buffer[32];
+    vec3_t* positions = NULL;
     tex2_t* texcoords = NULL;
 
     while ((read = fscanf(fp, "%s", buffer)) == 1) {
         if (strcmp(buffer, "v") == 0) {
             vec3_t vertex;
             fscanf(fp, "%f %f %f", &vertex.x, &vertex.y, &vertex.z);
-            array_push(mesh->vertices, vertex);
+            array_push(positions, vertex);
 
         } else if (strcmp(buffer, "vt") == 0) {
             tex2_t texcoord;
@@ -50,6 +115,19 @@ bool load_mesh_obj_data(mesh_t* mesh, char* obj_filename) {
         }
     }
 
+    // one stream per component so the vertices can be transformed in batches
+    mesh->num_vertices = array_length(positions);
+    mesh->vertices = allocate_streams(mesh->num_vertices, false);
+    for (int i = 0; i < mesh->num_vertices; ++i) {
+        mesh->vertices.x[i] = positions[i].x;
+        mesh->vertices.y[i] = positions[i].y;
+        mesh->vertices.z[i] = positions[i].z;
+    }
+
+    compute_mesh_bounds(mesh, positions);
+    compute_face_planes(mesh, positions);
+
+    array_free(positions);
     array_free(texcoords);
     fclose(fp);
 
@@ -58,38 +136,69 @@ bool load_mesh_obj_data(mesh_t* mesh, char* obj_filename) {
 
 bool load_mesh_png_data(mesh_t* mesh, char* png_filename) {
     upng_t* png_image = upng_new_from_file(png_filename);
-    if (png_image != NULL) {
-        upng_decode(png_image);
-        if (upng_get_error(png_image) == UPNG_EOK) {
-            mesh->texture = png_image;
-            return true;
-        }
+    if (png_image == NULL) {
+        return false;
+    }
+
+    bool is_loaded = false;
+    upng_decode(png_image);
+    if (upng_get_error(png_image) == UPNG_EOK) {
+        // keep a tiled copy for sampling, the decoded png isn't needed after this
+        mesh->texture = create_texture(
+            (uint32_t*) upng_get_buffer(png_image),
+            upng_get_width(png_image),
+            upng_get_height(png_image)
+        );
+        is_loaded = mesh->texture != NULL;
     }
-    return false;
+
+    upng_free(png_image);
+    return is_loaded;
+}
+
+// releases whatever a mesh has loaded so far, any of it may still be NULL
+static void free_mesh(mesh_t* mesh) {
+    free_texture(mesh->texture);
+    array_free(mesh->faces);
+    free_streams(&mesh->vertices);
+    free_streams(&mesh->view_vertices);
+    free_streams(&mesh->clip_vertices);
+    free(mesh->vertex_outcodes);
 }
 
+// the mesh is built up on the side and only takes a slot once it has loaded,
+// so a failed load leaves nothing behind for the next one to trip over
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation) {
     if (mesh_count == MAX_NUM_MESHES) {
         printf("Maximum number of meshes (%d) reached!\n", MAX_NUM_MESHES);
         return;
     }
 
-    mesh_t* mesh = &meshes[mesh_count];
-    mesh->scale = scale;
-    mesh->translation = translation;
-    mesh->rotation = rotation;
+    mesh_t mesh = {
+        .scale = scale,
+        .translation = translation,
+        .rotation = rotation,
+        .built_view_version = -1
+    };
 
-    if (!load_mesh_obj_data(mesh, obj_filename)) {
+    if (!load_mesh_obj_data(&mesh, obj_filename)) {
         printf("Failed to load mesh file: %s\n", obj_filename);
+        free_mesh(&mesh);
         return;
     }
 
-    if (!load_mesh_png_data(mesh, png_filename)) {
+    // room for the geometry pipeline's per-frame transformed vertices
+    mesh.view_vertices = allocate_streams(mesh.num_vertices, false);
+    mesh.clip_vertices = allocate_streams(mesh.num_vertices, true);
+    mesh.vertex_outcodes = malloc(sizeof(uint16_t) * mesh.num_vertices);
+
+    if (!load_mesh_png_data(&mesh, png_filename)) {
         printf("Failed to load texture file: %s\n", png_filename);
+        free_mesh(&mesh);
         return;
     }
 
-    ++mesh_count;
+    meshes[mesh_count++] = mesh;
 }
 
 int get_num_meshes(void) {
@@ -102,8 +211,89 @@ mesh_t* get_mesh(int index) {
 
 void free_meshes(void) {
     for (int i = 0; i < mesh_count; ++i) {
-        upng_free(meshes[i].texture);
-        array_free(meshes[i].faces);
-        array_free(meshes[i].vertices);
+        free_mesh(&meshes[i]);
+    }
+}
+
+static bool vec3_equal(vec3_t a, vec3_t b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// rebuilds the cached transforms once the mesh or the camera has moved
+void update_mesh_transforms(mesh_t* mesh, const mat4_t* view_matrix, int view_version) {
+    bool is_current = mesh->built_view_version == view_version
+        && vec3_equal(mesh->built_rotation, mesh->rotation)
+        && vec3_equal(mesh->built_scale, mesh->scale)
+        && vec3_equal(mesh->built_translation, mesh->translation);
+    if (is_current) {
+        return;
+    }
+
+    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
+    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
+    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
+    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+
+    mat4_t rotation_matrix = mat4_identity();
+    rotation_matrix = mat4_mul_mat4(rotation_matrix_z, rotation_matrix);
+    rotation_matrix = mat4_mul_mat4(rotation_matrix_y, rotation_matrix);
+    rotation_matrix = mat4_mul_mat4(rotation_matrix_x, rotation_matrix);
+
+    // order matters: scale -> rotate -> translate
+    mat4_t world_matrix = mat4_identity();
+    world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+    world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+    world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+
+    mesh->world_view_matrix = mat4_mul_mat4(*view_matrix, world_matrix);
+
+    // normals skip the translations and the size of the scale, which keeps
+    // them unit length; only its sign, which mirrors them, is kept
+    mat4_t mirror_matrix = mat4_make_scale(
+        mesh->scale.x < 0 ? -1 : 1,
+        mesh->scale.y < 0 ? -1 : 1,
+        mesh->scale.z < 0 ? -1 : 1
+    );
+    mesh->normal_matrix = mat4_mul_mat4(*view_matrix, mat4_mul_mat4(rotation_matrix, mirror_matrix));
+
+    // the view matrix is a rotation then a translation, so its rotation's
+    // transpose takes the translation back to the eye in world space, then
+    // undoing the world matrix step by step takes it into object space
+    mat4_t view_rotation_inverse = mat4_transpose(*view_matrix);
+    vec3_t view_translation = { view_matrix->m[0][3], view_matrix->m[1][3], view_matrix->m[2][3] };
+    vec3_t eye = vec3_sub(vec3_new(0, 0, 0), mat4_mul_vec3_direction(view_rotation_inverse, view_translation));
+    eye = mat4_mul_vec3_direction(mat4_transpose(rotation_matrix), vec3_sub(eye, mesh->translation));
+    mesh->object_eye_position = vec3_new(eye.x / mesh->scale.x, eye.y / mesh->scale.y, eye.z / mesh->scale.z);
+
+    mesh->built_rotation = mesh->rotation;
+    mesh->built_scale = mesh->scale;
+    mesh->built_translation = mesh->translation;
+    mesh->built_view_version = view_version;
+}
+
+// the sphere is tried first as it is cheapest, then the box, which fits
+// long flat meshes like the runway much more closely
+bool is_mesh_outside_frustum(const mesh_t* mesh) {
+    const mat4_t* world_view_matrix = &mesh->world_view_matrix;
+
+    // the world matrix is the only part that scales
+    float largest_scale = fmaxf(fabsf(mesh->scale.x), fmaxf(fabsf(mesh->scale.y), fabsf(mesh->scale.z)));
+    vec4_t centre = mat4_mul_vec4(*world_view_matrix, vec4_from_vec3(mesh->bounds_centre));
+    if (is_sphere_outside_frustum(vec3_from_vec4(centre), mesh->bounds_radius * largest_scale)) {
+        return true;
+    }
+
+    vec3_t corners[8];
+    for (int i = 0; i < 8; ++i) {
+        vec3_t corner = {
+            (i & 1) ? mesh->bounds_max.x : mesh->bounds_min.x,
+            (i & 2) ? mesh->bounds_max.y : mesh->bounds_min.y,
+            (i & 4) ? mesh->bounds_max.z : mesh->bounds_min.z
+        };
+        corners[i] = vec3_from_vec4(mat4_mul_vec4(*world_view_matrix, vec4_from_vec3(corner)));
     }
+    return are_points_outside_frustum(corners, 8);
 }
@@ -1,22 +1,46 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdbool.h>
+#include "matrix.h"
 #include "vector.h"
 #include "triangle.h"
-#include "upng.h"
+#include "texture.h"
+
+#define MAX_NUM_MESHES 10
 
 typedef struct {
-    vec3_t* vertices;
+    int num_vertices;
+    vec4_streams_t vertices; // model space, w is implicitly 1
     face_t* faces;
-    upng_t* texture;
+    vec4_streams_t view_vertices; // vertices in view space, transformed once a frame
+    vec4_streams_t clip_vertices; // view_vertices times the projection matrix
+    uint16_t* vertex_outcodes; // the clipping outcode of each view space vertex
+    texture_t* texture;
+    vec3_t bounds_min; // model space bounding box
+    vec3_t bounds_max;
+    vec3_t bounds_centre; // model space bounding sphere
+    float bounds_radius;
     vec3_t rotation;
     vec3_t scale;
     vec3_t translation;
+
+    // transforms cached along with what they were built from, so they are
+    // only rebuilt once the mesh or the camera has moved
+    mat4_t world_view_matrix; // world then view in one matrix
+    mat4_t normal_matrix; // the world then view rotations, for face normals
+    vec3_t object_eye_position; // the camera in object space
+    vec3_t built_rotation;
+    vec3_t built_scale;
+    vec3_t built_translation;
+    int built_view_version;
 } mesh_t;
 
 void load_mesh(char* obj_filename, char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
 int get_num_meshes(void);
 mesh_t* get_mesh(int index);
 void free_meshes(void);
+void update_mesh_transforms(mesh_t* mesh, const mat4_t* view_matrix, int view_version);
+bool is_mesh_outside_frustum(const mesh_t* mesh);
 
 #endif
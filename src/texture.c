@@ -1,6 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include "texture.h"
 
+static texture_t* textures[MAX_NUM_TEXTURES];
+
 tex2_t tex2_clone(tex2_t* t) {
     tex2_t result = { t->u, t->v };
     return result;
 }
+
+static int next_power_of_two(int value) {
+    int power = TEXTURE_TILE_SIZE;
+    while (power < value) {
+        power <<= 1;
+    }
+    return power;
+}
+
+static int log2_of_power_of_two(int value) {
+    int log2 = 0;
+    while ((1 << log2) < value) {
+        ++log2;
+    }
+    return log2;
+}
+
+static void initialise_texture_level(texture_level_t* level, int width, int height) {
+    level->width = width;
+    level->height = height;
+    level->width_mask = width - 1;
+    level->height_mask = height - 1;
+    level->tile_row_shift = log2_of_power_of_two(width) + TEXTURE_TILE_BITS;
+    level->texels = (uint32_t*) malloc(sizeof(uint32_t) * width * height);
+}
+
+// averages each channel of the 2x2 (or 2x1 once a side has reached a
+// single tile) block of texels above every texel of the new level
+static void downsample_texture_level(texture_level_t* level, const texture_level_t* source) {
+    int step_x = source->width / level->width;
+    int step_y = source->height / level->height;
+    int num_samples = step_x * step_y;
+
+    for (int y = 0; y < level->height; ++y) {
+        for (int x = 0; x < level->width; ++x) {
+            uint32_t channel_sums[4] = { 0, 0, 0, 0 };
+            for (int sample_y = 0; sample_y < step_y; ++sample_y) {
+                for (int sample_x = 0; sample_x < step_x; ++sample_x) {
+                    uint32_t texel = source->texels[get_texel_index(source, x * step_x + sample_x, y * step_y + sample_y)];
+                    for (int channel = 0; channel < 4; ++channel) {
+                        channel_sums[channel] += (texel >> (channel * 8)) & 0xFF;
+                    }
+                }
+            }
+
+            uint32_t texel = 0;
+            for (int channel = 0; channel < 4; ++channel) {
+                uint32_t average = (channel_sums[channel] + num_samples / 2) / num_samples;
+                texel |= average << (channel * 8);
+            }
+            level->texels[get_texel_index(level, x, y)] = texel;
+        }
+    }
+}
+
+// copies row-major pixels into tiled storage, scaling up to power-of-two
+// dimensions with nearest neighbour sampling where needed, then builds the
+// mip chain down to a single tile; returns NULL if every handle is taken
+texture_t* create_texture(const uint32_t* pixels, int width, int height) {
+    // triangles name their texture by handle, so a texture without one
+    // couldn't be drawn; refuse it rather than hand out handle 0
+    int handle = 1;
+    while (handle < MAX_NUM_TEXTURES && textures[handle] != NULL) {
+        ++handle;
+    }
+    if (handle == MAX_NUM_TEXTURES) {
+        printf("Maximum number of textures (%d) reached!\n", MAX_NUM_TEXTURES - 1);
+        return NULL;
+    }
+
+    texture_t* texture = (texture_t*) malloc(sizeof(texture_t));
+
+    texture_level_t* base = &texture->levels[0];
+    initialise_texture_level(base, next_power_of_two(width), next_power_of_two(height));
+    for (int y = 0; y < base->height; ++y) {
+        int source_y = (int) ((int64_t) y * height / base->height);
+        for (int x = 0; x < base->width; ++x) {
+            int source_x = (int) ((int64_t) x * width / base->width);
+            base->texels[get_texel_index(base, x, y)] = pixels[source_y * width + source_x];
+        }
+    }
+
+    texture->num_levels = 1;
+    while (texture->num_levels < TEXTURE_MAX_LEVELS) {
+        const texture_level_t* previous = &texture->levels[texture->num_levels - 1];
+        if (previous->width == TEXTURE_TILE_SIZE && previous->height == TEXTURE_TILE_SIZE) {
+            break;
+        }
+
+        texture_level_t* level = &texture->levels[texture->num_levels];
+        int level_width = previous->width > TEXTURE_TILE_SIZE ? previous->width / 2 : TEXTURE_TILE_SIZE;
+        int level_height = previous->height > TEXTURE_TILE_SIZE ? previous->height / 2 : TEXTURE_TILE_SIZE;
+        initialise_texture_level(level, level_width, level_height);
+        downsample_texture_level(level, previous);
+        ++texture->num_levels;
+    }
+
+    textures[handle] = texture;
+    texture->handle = handle;
+    return texture;
+}
+
+void free_texture(texture_t* texture) {
+    if (texture != NULL) {
+        textures[texture->handle] = NULL;
+        for (int i = 0; i < texture->num_levels; ++i) {
+            free(texture->levels[i].texels);
+        }
+        free(texture);
+    }
+}
+
+const texture_t* get_texture(int handle) {
+    return textures[handle];
+}
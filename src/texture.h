@@ -1,11 +1,56 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <stdint.h>
+
 typedef struct {
     float u;
     float v;
 } tex2_t;
 
+// texels are stored in 4x4 tiles, each filling a 64 byte cache line, so a
+// small step in any direction usually stays in the same line; both
+// dimensions are powers of two so coordinates wrap with a mask
+#define TEXTURE_TILE_BITS 2
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_BITS)
+#define TEXTURE_TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * sizeof(uint32_t))
+
+// mip levels halve down to a single tile, 16 levels covers 128k texels a side
+#define TEXTURE_MAX_LEVELS 16
+
+typedef struct {
+    int width;
+    int height;
+    int width_mask;
+    int height_mask;
+    int tile_row_shift; // log2 of the texels in one row of tiles
+    uint32_t* texels;
+} texture_level_t;
+
+// levels[0] is the full size image, each level after it is box filtered
+// from the one before
+typedef struct {
+    int num_levels;
+    texture_level_t levels[TEXTURE_MAX_LEVELS];
+    int handle;
+} texture_t;
+
+// live textures are numbered so a triangle can name its texture in a byte;
+// handle 0 is no texture
+#define MAX_NUM_TEXTURES 256
+
 tex2_t tex2_clone(tex2_t* t);
 
+texture_t* create_texture(const uint32_t* pixels, int width, int height);
+void free_texture(texture_t* texture);
+const texture_t* get_texture(int handle);
+
+// x and y must already be wrapped into the texture
+static inline int get_texel_index(const texture_level_t* level, int x, int y) {
+    return ((y >> TEXTURE_TILE_BITS) << level->tile_row_shift)
+        | ((x >> TEXTURE_TILE_BITS) << (2 * TEXTURE_TILE_BITS))
+        | ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_BITS)
+        | (x & (TEXTURE_TILE_SIZE - 1));
+}
+
 #endif
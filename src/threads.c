@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <SDL.h>
+#include "threads.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread pool
+///////////////////////////////////////////////////////////////////////////////
+// A fixed set of worker threads that sleep until a batch of jobs is
+// submitted. Jobs are handed out through an atomic counter, and the
+// submitting thread works through the batch alongside the workers before
+// waiting for the stragglers, so a pool of size 1 simply runs the jobs
+// inline.
+///////////////////////////////////////////////////////////////////////////////
+struct thread_pool {
+    SDL_Thread** threads;
+    int num_threads;
+
+    SDL_mutex* mutex;
+    SDL_cond* work_ready;
+    SDL_cond* work_done;
+    int generation;
+    int num_busy_workers;
+    bool is_shutting_down;
+
+    thread_job_t job;
+    void* job_data;
+    int num_jobs;
+    SDL_atomic_t next_job;
+};
+
+typedef struct {
+    thread_pool_t* pool;
+    int thread_index;
+} worker_t;
+
+static void run_jobs(thread_pool_t* pool, int thread_index) {
+    int job_index;
+    while ((job_index = SDL_AtomicAdd(&pool->next_job, 1)) < pool->num_jobs) {
+        pool->job(job_index, thread_index, pool->job_data);
+    }
+}
+
+static int worker_main(void* data) {
+    worker_t* worker = data;
+    thread_pool_t* pool = worker->pool;
+    int thread_index = worker->thread_index;
+    free(worker);
+
+    int seen_generation = 0;
+
+    SDL_LockMutex(pool->mutex);
+    while (true) {
+        while (pool->generation == seen_generation && !pool->is_shutting_down) {
+            SDL_CondWait(pool->work_ready, pool->mutex);
+        }
+        if (pool->is_shutting_down) {
+            break;
+        }
+        seen_generation = pool->generation;
+        SDL_UnlockMutex(pool->mutex);
+
+        run_jobs(pool, thread_index);
+
+        SDL_LockMutex(pool->mutex);
+        if (--pool->num_busy_workers == 0) {
+            SDL_CondSignal(pool->work_done);
+        }
+    }
+    SDL_UnlockMutex(pool->mutex);
+
+    return 0;
+}
+
+thread_pool_t* create_thread_pool(int num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    thread_pool_t* pool = (thread_pool_t*) calloc(1, sizeof(thread_pool_t));
+    pool->num_threads = num_threads;
+    pool->mutex = SDL_CreateMutex();
+    pool->work_ready = SDL_CreateCond();
+    pool->work_done = SDL_CreateCond();
+    pool->threads = (SDL_Thread**) calloc(num_threads, sizeof(SDL_Thread*));
+
+    // the submitting thread acts as thread 0
+    for (int i = 1; i < num_threads; ++i) {
+        worker_t* worker = (worker_t*) malloc(sizeof(worker_t));
+        worker->pool = pool;
+        worker->thread_index = i;
+
+        pool->threads[i] = SDL_CreateThread(worker_main, "worker", worker);
+        if (pool->threads[i] == NULL) {
+            fprintf(stderr, "Error creating worker thread: %s\n", SDL_GetError());
+            free(worker);
+            pool->num_threads = i;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+int get_thread_pool_size(thread_pool_t* pool) {
+    return pool->num_threads;
+}
+
+void run_thread_pool_jobs(thread_pool_t* pool, int num_jobs, thread_job_t job, void* data) {
+    pool->job = job;
+    pool->job_data = data;
+    pool->num_jobs = num_jobs;
+    SDL_AtomicSet(&pool->next_job, 0);
+
+    if (pool->num_threads == 1 || num_jobs <= 1) {
+        run_jobs(pool, 0);
+        return;
+    }
+
+    SDL_LockMutex(pool->mutex);
+    pool->num_busy_workers = pool->num_threads - 1;
+    ++pool->generation;
+    SDL_CondBroadcast(pool->work_ready);
+    SDL_UnlockMutex(pool->mutex);
+
+    run_jobs(pool, 0);
+
+    SDL_LockMutex(pool->mutex);
+    while (pool->num_busy_workers > 0) {
+        SDL_CondWait(pool->work_done, pool->mutex);
+    }
+    SDL_UnlockMutex(pool->mutex);
+}
+
+void destroy_thread_pool(thread_pool_t* pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    SDL_LockMutex(pool->mutex);
+    pool->is_shutting_down = true;
+    SDL_CondBroadcast(pool->work_ready);
+    SDL_UnlockMutex(pool->mutex);
+
+    for (int i = 1; i < pool->num_threads; ++i) {
+        SDL_WaitThread(pool->threads[i], NULL);
+    }
+
+    SDL_DestroyCond(pool->work_done);
+    SDL_DestroyCond(pool->work_ready);
+    SDL_DestroyMutex(pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,17 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <stdbool.h>
+
+typedef struct thread_pool thread_pool_t;
+
+// job_index runs from 0 to num_jobs - 1; thread_index identifies the thread
+// running the job, 0 being the thread that submitted the jobs
+typedef void (*thread_job_t)(int job_index, int thread_index, void* data);
+
+thread_pool_t* create_thread_pool(int num_threads);
+int get_thread_pool_size(thread_pool_t* pool);
+void run_thread_pool_jobs(thread_pool_t* pool, int num_jobs, thread_job_t job, void* data);
+void destroy_thread_pool(thread_pool_t* pool);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include "tiles.h"
+#include "display.h"
+#include "threads.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Tile-binned rendering
+///////////////////////////////////////////////////////////////////////////////
+// The screen is split into TILE_SIZE x TILE_SIZE tiles and every triangle is
+// binned into the tiles its bounding box touches, keeping submission order
+// within each bin. Tiles are then rasterized independently by the thread pool,
+// each clipped to its own region of the colour and z buffers, so no locking is
+// needed and every pixel sees the same sequence of writes as it would when
+// rendering serially. Clearing only sets flags, so it is done up front for the
+// whole window, and each tile expands its own leftover colour clears.
+///////////////////////////////////////////////////////////////////////////////
+static thread_pool_t* thread_pool = NULL;
+
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+
+static int* bin_offsets = NULL; // num_tiles + 1 entries
+static int* bin_triangles = NULL;
+static int bin_triangles_capacity = 0;
+
+static raster_stats_t* thread_stats = NULL;
+
+typedef struct {
+    const triangle_setup_t* triangles;
+} tile_job_t;
+
+bool initialise_tile_renderer(int num_threads) {
+    thread_pool = create_thread_pool(num_threads);
+
+    num_tiles_x = (get_window_width() + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles_y = (get_window_height() + TILE_SIZE - 1) / TILE_SIZE;
+    bin_offsets = (int*) malloc(sizeof(int) * (num_tiles_x * num_tiles_y + 1));
+    thread_stats = (raster_stats_t*) malloc(sizeof(raster_stats_t) * get_thread_pool_size(thread_pool));
+
+    return thread_pool != NULL && bin_offsets != NULL && thread_stats != NULL;
+}
+
+int get_num_render_threads(void) {
+    return thread_pool != NULL ? get_thread_pool_size(thread_pool) : 1;
+}
+
+// the range of tiles touched by a triangle, including its wireframe and
+// vertex markers; returns false if it is entirely off screen
+static bool get_triangle_tiles(const triangle_setup_t* triangle, int* min_tile_x, int* min_tile_y, int* max_tile_x, int* max_tile_y) {
+    int min_x = triangle->x[0];
+    int min_y = triangle->y[0];
+    int max_x = min_x;
+    int max_y = min_y;
+    for (int i = 1; i < 3; ++i) {
+        int x = triangle->x[i];
+        int y = triangle->y[i];
+        if (x < min_x) min_x = x;
+        if (y < min_y) min_y = y;
+        if (x > max_x) max_x = x;
+        if (y > max_y) max_y = y;
+    }
+
+    // vertex markers reach 3 pixels either side of a vertex
+    min_x -= 4;
+    min_y -= 4;
+    max_x += 4;
+    max_y += 4;
+
+    if (max_x < 0 || max_y < 0 || min_x >= get_window_width() || min_y >= get_window_height()) {
+        return false;
+    }
+
+    *min_tile_x = min_x < 0 ? 0 : min_x / TILE_SIZE;
+    *min_tile_y = min_y < 0 ? 0 : min_y / TILE_SIZE;
+    *max_tile_x = max_x >= get_window_width() ? num_tiles_x - 1 : max_x / TILE_SIZE;
+    *max_tile_y = max_y >= get_window_height() ? num_tiles_y - 1 : max_y / TILE_SIZE;
+    return true;
+}
+
+static void bin_triangles_into_tiles(const triangle_setup_t* triangles, int num_triangles) {
+    int num_tiles = num_tiles_x * num_tiles_y;
+    int min_tile_x, min_tile_y, max_tile_x, max_tile_y;
+
+    // count the triangles in each bin, shifted by one for the prefix sum
+    for (int i = 0; i <= num_tiles; ++i) {
+        bin_offsets[i] = 0;
+    }
+    for (int t = 0; t < num_triangles; ++t) {
+        if (!get_triangle_tiles(&triangles[t], &min_tile_x, &min_tile_y, &max_tile_x, &max_tile_y)) {
+            continue;
+        }
+        for (int tile_y = min_tile_y; tile_y <= max_tile_y; ++tile_y) {
+            for (int tile_x = min_tile_x; tile_x <= max_tile_x; ++tile_x) {
+                ++bin_offsets[tile_y * num_tiles_x + tile_x + 1];
+            }
+        }
+    }
+
+    for (int i = 0; i < num_tiles; ++i) {
+        bin_offsets[i + 1] += bin_offsets[i];
+    }
+
+    int total_entries = bin_offsets[num_tiles];
+    if (total_entries > bin_triangles_capacity) {
+        bin_triangles_capacity = total_entries * 2;
+        bin_triangles = (int*) realloc(bin_triangles, sizeof(int) * bin_triangles_capacity);
+    }
+
+    // fill the bins in submission order, leaving each offset at the end of
+    // its bin, then shift the offsets back to the start of each bin
+    for (int t = 0; t < num_triangles; ++t) {
+        if (!get_triangle_tiles(&triangles[t], &min_tile_x, &min_tile_y, &max_tile_x, &max_tile_y)) {
+            continue;
+        }
+        for (int tile_y = min_tile_y; tile_y <= max_tile_y; ++tile_y) {
+            for (int tile_x = min_tile_x; tile_x <= max_tile_x; ++tile_x) {
+                int tile_index = tile_y * num_tiles_x + tile_x;
+                bin_triangles[bin_offsets[tile_index]++] = t;
+            }
+        }
+    }
+
+    for (int i = num_tiles; i > 0; --i) {
+        bin_offsets[i] = bin_offsets[i - 1];
+    }
+    bin_offsets[0] = 0;
+}
+
+static void render_tile(int tile_index, int thread_index, void* data) {
+    const tile_job_t* job = data;
+
+    SDL_Rect clip = {
+        .x = (tile_index % num_tiles_x) * TILE_SIZE,
+        .y = (tile_index / num_tiles_x) * TILE_SIZE,
+        .w = TILE_SIZE,
+        .h = TILE_SIZE
+    };
+    if (clip.x + clip.w > get_window_width()) clip.w = get_window_width() - clip.x;
+    if (clip.y + clip.h > get_window_height()) clip.h = get_window_height() - clip.y;
+
+    draw_binned_triangles(
+        job->triangles,
+        &bin_triangles[bin_offsets[tile_index]],
+        bin_offsets[tile_index + 1] - bin_offsets[tile_index],
+        &clip,
+        &thread_stats[thread_index]);
+
+    if (should_render_visibility_buffer()) {
+        resolve_visibility_buffer(job->triangles, &clip, &thread_stats[thread_index]);
+    }
+
+    resolve_fast_clears(&clip);
+}
+
+void render_tiles(const triangle_setup_t* triangles, int num_triangles, uint32_t background_colour, uint32_t grid_colour, raster_stats_t* stats) {
+    bin_triangles_into_tiles(triangles, num_triangles);
+
+    clear_colour_buffer(background_colour, grid_colour, NULL);
+    clear_z_buffer(NULL);
+
+    int num_threads = get_thread_pool_size(thread_pool);
+    for (int i = 0; i < num_threads; ++i) {
+        thread_stats[i] = (raster_stats_t) { 0 };
+    }
+
+    tile_job_t job = {
+        .triangles = triangles
+    };
+    run_thread_pool_jobs(thread_pool, num_tiles_x * num_tiles_y, render_tile, &job);
+
+    for (int i = 0; i < num_threads; ++i) {
+        add_raster_stats(stats, &thread_stats[i]);
+    }
+}
+
+void destroy_tile_renderer(void) {
+    destroy_thread_pool(thread_pool);
+    thread_pool = NULL;
+    free(thread_stats);
+    free(bin_triangles);
+    free(bin_offsets);
+    thread_stats = NULL;
+    bin_triangles = NULL;
+    bin_offsets = NULL;
+    bin_triangles_capacity = 0;
+}
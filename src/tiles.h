@@ -0,0 +1,15 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "triangle.h"
+
+#define TILE_SIZE 64
+
+bool initialise_tile_renderer(int num_threads);
+int get_num_render_threads(void);
+void render_tiles(const triangle_setup_t* triangles, int num_triangles, uint32_t background_colour, uint32_t grid_colour, raster_stats_t* stats);
+void destroy_tile_renderer(void);
+
+#endif
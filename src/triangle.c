@@ -1,6 +1,20 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include "triangle.h"
 #include "display.h"
-#include "swap.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RASTER_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// kernel bodies are forced inline into each instantiation, see Raster kernels
+#if defined(__GNUC__)
+#define RASTER_INLINE static inline __attribute__((always_inline))
+#else
+#define RASTER_INLINE static inline
+#endif
 
 vec3_t get_triangle_normal(vec4_t vertices[3]) {
     vec3_t vector_a = vec3_from_vec4(vertices[0]); /*   A  */  
@@ -17,287 +31,1154 @@ vec3_t get_triangle_normal(vec4_t vertices[3]) {
     return normal;
 }
 
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t colour) {
-    draw_line(x0, y0, x1, y1, colour);
-    draw_line(x1, y1, x2, y2, colour);
-    draw_line(x2, y2, x0, y0, colour);
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t colour, const SDL_Rect* clip) {
+    draw_line(x0, y0, x1, y1, colour, clip);
+    draw_line(x1, y1, x2, y2, colour, clip);
+    draw_line(x2, y2, x0, y0, colour, clip);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Half-space rasterizer
+///////////////////////////////////////////////////////////////////////////////
+// Each edge of the triangle is described by an integer edge function
+// E(x, y) = a * x + b * y + c, which is positive on the inside of the edge.
+// The bounding box of the triangle is walked in aligned blocks: blocks that
+// lie outside any edge are skipped, blocks inside all three edges skip the
+// per-pixel edge tests, and the rest are tested pixel by pixel. Covered
+// pixels are handed to a span shader one row at a time.
+//
+// Vertices are snapped to a fixed-point grid with SUBPIXEL_BITS of
+// sub-pixel precision and pixels are sampled at their centres. Together
+// with a strict top-left fill rule this means pixels on an edge shared by
+// two triangles are drawn exactly once.
+//
+// Attributes that vary linearly in screen space (1/w, u/w and v/w) are set
+// up once per triangle as plane equations, so a span evaluates them at its
+// first pixel and then steps them with adds.
+//
+// Blocks line up with the hi-z buffer tiles, so a block whose farthest
+// stored depth is no farther than the triangle's nearest point is skipped
+// before any per-pixel work. The same tiles carry the fast clear flags, so
+// a block that survives materialises its tile's clear first.
+///////////////////////////////////////////////////////////////////////////////
+#define RASTER_BLOCK_SIZE HI_Z_TILE_SIZE
+
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+
+// evaluated at pixel centres in whole pixel steps, so a and b are scaled up
+// from sub-pixel units and c carries the half pixel offset
+typedef struct {
+    int a;
+    int b;
+    int64_t c;
+    int bias; // top-left fill rule, -1 for edges that don't own their pixels
+} edge_function_t;
+
+typedef struct {
+    edge_function_t edges[3]; // edges[i] is opposite vertex i
+    float inv_area;
+    float nearest_depth;
+    float origin_x; // attribute planes are relative to the first vertex
+    float origin_y;
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+} raster_triangle_t;
+
+// an attribute as a function of screen position, value + dx * x + dy * y
+// with x and y relative to the triangle's origin
+typedef struct {
+    float value;
+    float dx;
+    float dy;
+} attribute_plane_t;
+
+// returns the number of pixels that passed the depth test
+typedef int (*span_shader_t)(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data);
+
+// every pass the render method asks for, over a batch of triangles
+typedef void (*triangle_list_kernel_t)(
+    const triangle_setup_t* triangles, const int* indices, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats);
+
+// the kernels for the current render method and depth format, picked by
+// select_raster_kernels before a frame is drawn
+typedef struct {
+    span_shader_t filled_span;
+    span_shader_t textured_span;
+    span_shader_t visibility_span;
+    triangle_list_kernel_t draw_triangle_list;
+} raster_kernels_t;
+
+static raster_kernels_t kernels;
+
+static int64_t edge_function_at(const edge_function_t* edge, int x, int y) {
+    return (int64_t) edge->a * x + (int64_t) edge->b * y + edge->c;
+}
+
+static int snap_to_subpixel(float coordinate) {
+    return (int) floorf(coordinate * SUBPIXEL_SCALE + 0.5f);
 }
 
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
-    vec2_t ap = vec2_sub(p, a);
+static int64_t subpixel_area(int x0, int y0, int x1, int y1, int x2, int y2) {
+    return (int64_t) (x1 - x0) * (y2 - y0) - (int64_t) (y1 - y0) * (x2 - x0);
+}
 
-    float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x); // || AC x AB ||
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc; // || PC x PB || / || AC x AB ||
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc; // || AC x AP || / || AC x AB ||
-    float gamma = 1.0f - alpha - beta;
+// takes vertices in sub-pixel units
+static edge_function_t make_edge_function(int x0, int y0, int x1, int y1) {
+    int a = y0 - y1;
+    int b = x1 - x0;
+    int64_t c = (int64_t) x0 * y1 - (int64_t) x1 * y0;
 
-    vec3_t weights = {
-        .x = alpha,
-        .y = beta,
-        .z = gamma
+    edge_function_t edge = {
+        .a = a * SUBPIXEL_SCALE,
+        .b = b * SUBPIXEL_SCALE,
+        .c = c + (int64_t) (a + b) * (SUBPIXEL_SCALE / 2)
     };
-    return weights;
+
+    // triangles are wound clockwise on screen, so left edges run upwards
+    // and top edges run to the right
+    bool is_top_left = a > 0 || (a == 0 && b > 0);
+    edge.bias = is_top_left ? 0 : -1;
+    return edge;
 }
 
-void draw_triangle_pixel(
-    int x, int y, int32_t colour,
-    vec4_t point_a, vec4_t point_b, vec4_t point_c,
-    float recipricol_w_a, float recipricol_w_b, float recipricol_w_c
-) {
-    vec2_t p = { .x = x, .y = y };
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-    vec3_t weights = barycentric_weights(a, b, c, p);
+// the winding is decided here on the snapped vertices, the same ones the
+// rasterizer will see, so it never has to reorder them itself
+void setup_triangle(triangle_setup_t* setup, const triangle_t* triangle) {
+    const vec4_t* points = triangle->points;
+    int64_t area = subpixel_area(
+        snap_to_subpixel(points[0].x), snap_to_subpixel(points[0].y),
+        snap_to_subpixel(points[1].x), snap_to_subpixel(points[1].y),
+        snap_to_subpixel(points[2].x), snap_to_subpixel(points[2].y));
+
+    // wind clockwise so the edge functions are positive inside
+    int order[3] = { 0, 1, 2 };
+    if (area < 0) {
+        order[1] = 2;
+        order[2] = 1;
+    }
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+    for (int i = 0; i < 3; ++i) {
+        const vec4_t* point = &points[order[i]];
+        setup->x[i] = point->x;
+        setup->y[i] = point->y;
+        setup->recipricol_w[i] = 1.0 / point->w;
+        setup->u[i] = triangle->texcoords[order[i]].u;
+        // flip the v component to account for inverted in OBJ files
+        setup->v[i] = 1.0 - triangle->texcoords[order[i]].v;
+    }
+    setup->colour = triangle->colour & 0x00FFFFFF;
+    setup->texture = triangle->texture != NULL ? triangle->texture->handle : 0;
+}
+
+static uint32_t get_setup_colour(const triangle_setup_t* setup) {
+    return 0xFF000000 | setup->colour;
+}
 
-    float interpolated_recipricol_w = recipricol_w_a * alpha + recipricol_w_b * beta + recipricol_w_c * gamma;
+// returns false if the triangle has no area or covers nothing inside the clip
+static bool setup_raster_triangle(raster_triangle_t* triangle, const triangle_setup_t* setup, const SDL_Rect* clip) {
+    int x0 = snap_to_subpixel(setup->x[0]);
+    int y0 = snap_to_subpixel(setup->y[0]);
+    int x1 = snap_to_subpixel(setup->x[1]);
+    int y1 = snap_to_subpixel(setup->y[1]);
+    int x2 = snap_to_subpixel(setup->x[2]);
+    int y2 = snap_to_subpixel(setup->y[2]);
 
-    float z_buffer_w = 1.0 - interpolated_recipricol_w;
-    if (z_buffer_w < get_z_buffer_at(x, y)) {
-        draw_pixel(x, y, colour);
-        update_z_buffer_at(x, y, z_buffer_w);
+    int64_t area = subpixel_area(x0, y0, x1, y1, x2, y2);
+    if (area <= 0) {
+        return false;
     }
+
+    triangle->edges[0] = make_edge_function(x1, y1, x2, y2);
+    triangle->edges[1] = make_edge_function(x2, y2, x0, y0);
+    triangle->edges[2] = make_edge_function(x0, y0, x1, y1);
+    triangle->inv_area = 1.0f / area;
+    triangle->origin_x = (x0 - SUBPIXEL_SCALE / 2) / (float) SUBPIXEL_SCALE;
+    triangle->origin_y = (y0 - SUBPIXEL_SCALE / 2) / (float) SUBPIXEL_SCALE;
+
+    // the first and last pixel centres inside the sub-pixel bounds
+    int min_x = x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2);
+    int min_y = y0 < y1 ? (y0 < y2 ? y0 : y2) : (y1 < y2 ? y1 : y2);
+    int max_x = x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2);
+    int max_y = y0 > y1 ? (y0 > y2 ? y0 : y2) : (y1 > y2 ? y1 : y2);
+    triangle->min_x = (min_x - SUBPIXEL_SCALE / 2 + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    triangle->min_y = (min_y - SUBPIXEL_SCALE / 2 + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    triangle->max_x = (max_x - SUBPIXEL_SCALE / 2) >> SUBPIXEL_BITS;
+    triangle->max_y = (max_y - SUBPIXEL_SCALE / 2) >> SUBPIXEL_BITS;
+
+    // clip the bounding box to the screen
+    SDL_Rect rect = get_clip_rect(clip);
+    if (triangle->min_x < rect.x) triangle->min_x = rect.x;
+    if (triangle->min_y < rect.y) triangle->min_y = rect.y;
+    if (triangle->max_x > rect.x + rect.w - 1) triangle->max_x = rect.x + rect.w - 1;
+    if (triangle->max_y > rect.y + rect.h - 1) triangle->max_y = rect.y + rect.h - 1;
+
+    return triangle->min_x <= triangle->max_x && triangle->min_y <= triangle->max_y;
 }
 
-void draw_filled_triangle(
-    int x0, int y0, float z0, float w0,
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    uint32_t colour
-) {
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-    }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-
-    vec4_t point_a = { .x = x0, .y = y0, .z = z0, .w = w0 };
-    vec4_t point_b = { .x = x1, .y = y1, .z = z1, .w = w1  };
-    vec4_t point_c = { .x = x2, .y = y2, .z = z2, .w = w2  };
-
-    float recipricol_w_a = 1.0 / point_a.w;
-    float recipricol_w_b = 1.0 / point_b.w;
-    float recipricol_w_c = 1.0 / point_c.w;
-
-    // render flat-bottom triangle
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
-
-    if (y1 - y0 != 0) inv_slope_1 = (float) (x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0) inv_slope_2 = (float) (x2 - x0) / abs(y2 - y0);
-
-    if (y1 - y0 != 0) {
-        for (int y = y0; y <= y1; ++y) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
-
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+// the edge functions are the unnormalised barycentric weights of the
+// vertices, so their coefficients give the attribute's screen gradients
+static attribute_plane_t make_attribute_plane(const raster_triangle_t* triangle, float a0, float a1, float a2) {
+    const edge_function_t* edges = triangle->edges;
+    attribute_plane_t plane = {
+        .value = a0,
+        .dx = (a0 * edges[0].a + a1 * edges[1].a + a2 * edges[2].a) * triangle->inv_area,
+        .dy = (a0 * edges[0].b + a1 * edges[1].b + a2 * edges[2].b) * triangle->inv_area
+    };
+    return plane;
+}
+
+static float attribute_plane_at(const attribute_plane_t* plane, const raster_triangle_t* triangle, int x, int y) {
+    return plane->value + plane->dx * (x - triangle->origin_x) + plane->dy * (y - triangle->origin_y);
+}
+
+// depth is 1 - 1/w, so the nearest point of the triangle is at the vertex
+// with the largest 1/w; the margin covers rounding in the interpolation
+static float nearest_depth(const float recipricol_w[3]) {
+    float largest = recipricol_w[0];
+    if (recipricol_w[1] > largest) largest = recipricol_w[1];
+    if (recipricol_w[2] > largest) largest = recipricol_w[2];
+    return 1.0f - largest * 1.0001f;
+}
+
+static void rasterize_triangle(const raster_triangle_t* triangle, span_shader_t shade_span, const void* data, raster_stats_t* stats) {
+    const int block_extent = RASTER_BLOCK_SIZE - 1;
+    const edge_function_t* edges = triangle->edges;
+
+    // offsets from a block's origin to its most inside and most outside corners
+    int64_t inside_corner_offset[3];
+    int64_t outside_corner_offset[3];
+    for (int i = 0; i < 3; ++i) {
+        inside_corner_offset[i] = (int64_t) (edges[i].a > 0 ? edges[i].a : 0) * block_extent
+            + (int64_t) (edges[i].b > 0 ? edges[i].b : 0) * block_extent;
+        outside_corner_offset[i] = (int64_t) (edges[i].a < 0 ? edges[i].a : 0) * block_extent
+            + (int64_t) (edges[i].b < 0 ? edges[i].b : 0) * block_extent;
+    }
+
+    int first_block_x = triangle->min_x & ~block_extent;
+    int first_block_y = triangle->min_y & ~block_extent;
+
+    for (int block_y = first_block_y; block_y <= triangle->max_y; block_y += RASTER_BLOCK_SIZE) {
+        int y_start = block_y < triangle->min_y ? triangle->min_y : block_y;
+        int y_end = block_y + block_extent > triangle->max_y ? triangle->max_y : block_y + block_extent;
+
+        for (int block_x = first_block_x; block_x <= triangle->max_x; block_x += RASTER_BLOCK_SIZE) {
+            int x_start = block_x < triangle->min_x ? triangle->min_x : block_x;
+            int x_end = block_x + block_extent > triangle->max_x ? triangle->max_x : block_x + block_extent;
+
+            bool is_outside = false;
+            bool is_inside = true;
+            for (int i = 0; i < 3; ++i) {
+                int64_t origin = edge_function_at(&edges[i], block_x, block_y) + edges[i].bias;
+                if (origin + inside_corner_offset[i] < 0) {
+                    is_outside = true;
+                    break;
+                }
+                if (origin + outside_corner_offset[i] < 0) {
+                    is_inside = false;
+                }
+            }
+
+            if (is_outside) {
+                continue;
             }
 
-            for (int x = x_start; x < x_end; ++x) {
-                draw_triangle_pixel(
-                    x, y, colour,
-                    point_a, point_b, point_c,
-                    recipricol_w_a, recipricol_w_b, recipricol_w_c
-                );
+            if (triangle->nearest_depth >= get_hi_z_buffer_at(block_x, block_y)) {
+                stats->hi_z_rejected_pixels += (x_end - x_start + 1) * (y_end - y_start + 1);
+                continue;
+            }
+
+            // write out any pending clear before the spans read or write the tile
+            materialise_tile(block_x, block_y);
+
+            int num_written = 0;
+
+            if (is_inside) {
+                for (int y = y_start; y <= y_end; ++y) {
+                    num_written += shade_span(triangle, y, x_start, x_end + 1, data);
+                }
+                stats->pixels_tested += (x_end - x_start + 1) * (y_end - y_start + 1);
+            } else {
+                for (int y = y_start; y <= y_end; ++y) {
+                    int64_t w0 = edge_function_at(&edges[0], x_start, y) + edges[0].bias;
+                    int64_t w1 = edge_function_at(&edges[1], x_start, y) + edges[1].bias;
+                    int64_t w2 = edge_function_at(&edges[2], x_start, y) + edges[2].bias;
+
+                    // covered pixels on a row of a convex shape are contiguous
+                    int span_start = -1;
+                    int span_end = x_end + 1;
+                    for (int x = x_start; x <= x_end; ++x) {
+                        bool is_covered = (w0 | w1 | w2) >= 0;
+                        if (is_covered && span_start < 0) {
+                            span_start = x;
+                        } else if (!is_covered && span_start >= 0) {
+                            span_end = x;
+                            break;
+                        }
+                        w0 += edges[0].a;
+                        w1 += edges[1].a;
+                        w2 += edges[2].a;
+                    }
+
+                    if (span_start >= 0) {
+                        num_written += shade_span(triangle, y, span_start, span_end, data);
+                        stats->pixels_tested += span_end - span_start;
+                    }
+                }
+            }
+
+            if (num_written > 0) {
+                stats->pixels_written += num_written;
+                update_hi_z_buffer_tile(block_x, block_y);
             }
         }
     }
+}
 
-    // render flat-top triangle
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
+///////////////////////////////////////////////////////////////////////////////
+// Depth test
+///////////////////////////////////////////////////////////////////////////////
+// Spans interpolate 1/w and test it against the z buffer in its current
+// format. The float format stores 1 - 1/w and nearer pixels are smaller.
+// The rest store 1/w, or z_near / w in fixed point, and nearer pixels are
+// larger, which keeps the float format's precision where depths are far
+// apart and lets the fixed point formats round to the nearest step. The
+// formats don't give the same image: a 16 bit step is coarse enough that
+// nearly coplanar faces can land on the same code and resolve the other way,
+// and the float formats can differ from each other in the last bit.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+    void* row;
+    float unorm_scale;
+} depth_row_t;
 
-    if (y2 - y1 != 0) inv_slope_1 = (float) (x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0) inv_slope_2 = (float) (x2 - x0) / abs(y2 - y0);
+static depth_row_t get_depth_row(int y) {
+    depth_row_t depth = {
+        .row = get_z_buffer_row(y),
+        .unorm_scale = get_depth_unorm_scale()
+    };
+    return depth;
+}
 
-    if (y2 - y1 != 0) {
-        for (int y = y1; y <= y2; ++y) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+static uint32_t encode_unorm_depth(float recipricol_w, float scale, uint32_t max) {
+    uint32_t code = (uint32_t) (recipricol_w * scale + 0.5f);
+    return code < max ? code : max;
+}
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+// returns true and stores the depth if the pixel is nearer than the z buffer;
+// kernels pass a constant format, so only one case is left in each
+RASTER_INLINE bool test_and_write_depth(const depth_row_t* depth, int format, int x, float recipricol_w) {
+    switch (format) {
+        case DEPTH_REVERSED_FLOAT: {
+            float* stored = (float*) depth->row + x;
+            if (recipricol_w > *stored) {
+                *stored = recipricol_w;
+                return true;
             }
-
-            for (int x = x_start; x < x_end; ++x) {
-                draw_triangle_pixel(
-                    x, y, colour,
-                    point_a, point_b, point_c,
-                    recipricol_w_a, recipricol_w_b, recipricol_w_c
-                );
+            return false;
+        }
+        case DEPTH_UNORM16: {
+            uint16_t* stored = (uint16_t*) depth->row + x;
+            uint32_t code = encode_unorm_depth(recipricol_w, depth->unorm_scale, DEPTH_UNORM16_MAX);
+            if (code > *stored) {
+                *stored = code;
+                return true;
+            }
+            return false;
+        }
+        case DEPTH_UNORM24: {
+            uint8_t* stored = (uint8_t*) depth->row + x * 3;
+            uint32_t code = encode_unorm_depth(recipricol_w, depth->unorm_scale, DEPTH_UNORM24_MAX);
+            if (code > (uint32_t) (stored[0] | (stored[1] << 8) | (stored[2] << 16))) {
+                stored[0] = code;
+                stored[1] = code >> 8;
+                stored[2] = code >> 16;
+                return true;
+            }
+            return false;
+        }
+        default: {
+            float* stored = (float*) depth->row + x;
+            float z_buffer_w = 1.0 - recipricol_w;
+            if (z_buffer_w < *stored) {
+                *stored = z_buffer_w;
+                return true;
             }
+            return false;
         }
     }
 }
 
-void draw_triangle_texel(
-    int x, int y, upng_t* texture,
-    vec4_t point_a, vec4_t point_b, vec4_t point_c,
-    float recipricol_w_a, float recipricol_w_b, float recipricol_w_c,
-    tex2_t a_uv, tex2_t b_uv, tex2_t c_uv
-) {
-    vec2_t p = { .x = x, .y = y };
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-    vec3_t weights = barycentric_weights(a, b, c, p);
+typedef struct {
+    uint32_t colour;
+    attribute_plane_t recipricol_w;
+} filled_span_t;
+
+// spans lie inside the clip rect, so pixels are written without bounds checks
+RASTER_INLINE int draw_filled_span(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data, int depth_format) {
+    const filled_span_t* span = data;
+
+    uint32_t* colour_row = get_colour_buffer() + y * get_window_width();
+    depth_row_t depth = get_depth_row(y);
+    float interpolated_recipricol_w = attribute_plane_at(&span->recipricol_w, triangle, x_start, y);
+
+    int num_written = 0;
+    for (int x = x_start; x < x_end; ++x) {
+        if (test_and_write_depth(&depth, depth_format, x, interpolated_recipricol_w)) {
+            colour_row[x] = span->colour;
+            ++num_written;
+        }
+
+        interpolated_recipricol_w += span->recipricol_w.dx;
+    }
+
+    return num_written;
+}
+
+static void draw_filled_triangle(const triangle_setup_t* setup, const SDL_Rect* clip, raster_stats_t* stats) {
+    raster_triangle_t triangle;
+    if (!setup_raster_triangle(&triangle, setup, clip)) {
+        return;
+    }
+
+    const float* recipricol_w = setup->recipricol_w;
+    triangle.nearest_depth = nearest_depth(recipricol_w);
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+    filled_span_t span = {
+        .colour = get_setup_colour(setup),
+        .recipricol_w = make_attribute_plane(&triangle, recipricol_w[0], recipricol_w[1], recipricol_w[2])
+    };
 
-    float interpolated_u;
-    float interpolated_v;
-    float interpolated_recipricol_w;
+    rasterize_triangle(&triangle, kernels.filled_span, &span, stats);
+}
 
-    // find u/w and v/w for each point using weights and factor of 1/w
-    interpolated_u = a_uv.u * recipricol_w_a * alpha
-        + b_uv.u * recipricol_w_b * beta
-        + c_uv.u * recipricol_w_c * gamma;
-    interpolated_v = a_uv.v * recipricol_w_a * alpha
-        + b_uv.v * recipricol_w_b * beta
-        + c_uv.v * recipricol_w_c * gamma;
+typedef struct {
+    const texture_t* texture;
+    attribute_plane_t recipricol_w;
+    attribute_plane_t u_over_w;
+    attribute_plane_t v_over_w;
+    uint64_t* texture_bytes_touched; // NULL unless texture stats are being counted
+} textured_span_t;
 
-    interpolated_recipricol_w = recipricol_w_a * alpha + recipricol_w_b * beta + recipricol_w_c * gamma;
+static bool is_mipmapping = true;
 
-    interpolated_u /= interpolated_recipricol_w;
-    interpolated_v /= interpolated_recipricol_w;
+void toggle_mipmapping(void) {
+    is_mipmapping = !is_mipmapping;
+}
 
-    int texture_width = upng_get_width(texture);
-    int texture_height = upng_get_height(texture);
-    uint32_t* texture_buffer = (uint32_t*) upng_get_buffer(texture);
+// counting texture tiles costs a compare per fetch, so it only runs while
+// the stats are shown
+static bool is_counting_texture_tiles = false;
 
-    int tex_x = abs((int) (texture_width * interpolated_u)) % texture_width;
-    int tex_y = abs((int) (texture_height * interpolated_v)) % texture_height;
+void set_texture_stats_enabled(bool enabled) {
+    is_counting_texture_tiles = enabled;
+}
 
-    float z_buffer_w = 1.0 - interpolated_recipricol_w;
-    if (z_buffer_w < get_z_buffer_at(x, y)) {
-        draw_pixel(x, y, texture_buffer[tex_y * texture_width + tex_x]);
-        update_z_buffer_at(x, y, z_buffer_w);
+// picks the mip level nearest to one texel per pixel at (x, y), from the
+// screen space derivatives of the perspective correct texture coordinates
+static const texture_level_t* select_texture_level(const raster_triangle_t* triangle, const textured_span_t* span, int x, int y) {
+    const texture_t* texture = span->texture;
+    const texture_level_t* base = &texture->levels[0];
+    if (!is_mipmapping || texture->num_levels == 1) {
+        return base;
     }
+
+    float interpolated_recipricol_w = attribute_plane_at(&span->recipricol_w, triangle, x, y);
+    float interpolated_u_over_w = attribute_plane_at(&span->u_over_w, triangle, x, y);
+    float interpolated_v_over_w = attribute_plane_at(&span->v_over_w, triangle, x, y);
+
+    // u = (u/w) / (1/w), so du = (d(u/w) * (1/w) - (u/w) * d(1/w)) * w^2
+    float w_squared = 1.0f / (interpolated_recipricol_w * interpolated_recipricol_w);
+    float du_dx = (span->u_over_w.dx * interpolated_recipricol_w - interpolated_u_over_w * span->recipricol_w.dx) * w_squared * base->width;
+    float dv_dx = (span->v_over_w.dx * interpolated_recipricol_w - interpolated_v_over_w * span->recipricol_w.dx) * w_squared * base->height;
+    float du_dy = (span->u_over_w.dy * interpolated_recipricol_w - interpolated_u_over_w * span->recipricol_w.dy) * w_squared * base->width;
+    float dv_dy = (span->v_over_w.dy * interpolated_recipricol_w - interpolated_v_over_w * span->recipricol_w.dy) * w_squared * base->height;
+
+    float footprint_x = du_dx * du_dx + dv_dx * dv_dx;
+    float footprint_y = du_dy * du_dy + dv_dy * dv_dy;
+    float footprint = footprint_x > footprint_y ? footprint_x : footprint_y;
+    if (!(footprint > 1.0f)) {
+        return base;
+    }
+
+    // the footprint is squared, so half its exponent is the level; rounding
+    // down keeps the sharper level, which suits surfaces seen edge on
+    int level = ilogbf(footprint) / 2;
+    if (level > texture->num_levels - 1) {
+        level = texture->num_levels - 1;
+    }
+    return &texture->levels[level];
 }
 
-void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t* texture
+// adds a tile's worth of bytes each time a fetch lands in a different tile
+// to the one before it, as a stand-in for the cache lines a span pulls in
+static int count_touched_tiles(const int32_t* texel_indices, int num_lanes, int lane_mask, int* previous_tile) {
+    int num_tiles = 0;
+    for (int lane = 0; lane < num_lanes; ++lane) {
+        int tile = texel_indices[lane] >> (2 * TEXTURE_TILE_BITS);
+        if ((lane_mask & (1 << lane)) && tile != *previous_tile) {
+            *previous_tile = tile;
+            ++num_tiles;
+        }
+    }
+    return num_tiles;
+}
+
+// texture coordinates repeat, power-of-two sizes let a mask do the wrap
+static int get_wrapped_texel_index(const texture_level_t* level, float u, float v) {
+    int tex_x = (int) floorf(level->width * u) & level->width_mask;
+    int tex_y = (int) floorf(level->height * v) & level->height_mask;
+    return get_texel_index(level, tex_x, tex_y);
+}
+
+RASTER_INLINE int draw_textured_pixels(
+    const raster_triangle_t* triangle, const textured_span_t* span, const texture_level_t* level,
+    int y, int x_start, int x_end, int depth_format
 ) {
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-    if (y1 > y2) {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-        float_swap(&u1, &u2);
-        float_swap(&v1, &v2);
-    }
-    if (y0 > y1) {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-
-    // flip the v component to account for inverted in OBJ files
-    v0 = 1.0 - v0;
-    v1 = 1.0 - v1;
-    v2 = 1.0 - v2;
-
-    vec4_t point_a = { .x = x0, .y = y0, .z = z0, .w = w0 };
-    vec4_t point_b = { .x = x1, .y = y1, .z = z1, .w = w1  };
-    vec4_t point_c = { .x = x2, .y = y2, .z = z2, .w = w2  };
-    tex2_t a_uv = { .u = u0, .v = v0 };
-    tex2_t b_uv = { .u = u1, .v = v1 };
-    tex2_t c_uv = { .u = u2, .v = v2 };
-
-    float recipricol_w_a = 1.0 / point_a.w;
-    float recipricol_w_b = 1.0 / point_b.w;
-    float recipricol_w_c = 1.0 / point_c.w;
-
-    // render flat-bottom triangle
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
-
-    if (y1 - y0 != 0) inv_slope_1 = (float) (x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0) inv_slope_2 = (float) (x2 - x0) / abs(y2 - y0);
-
-    if (y1 - y0 != 0) {
-        for (int y = y0; y <= y1; ++y) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
-
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+    uint32_t* colour_row = get_colour_buffer() + y * get_window_width();
+    depth_row_t depth = get_depth_row(y);
+    float interpolated_recipricol_w = attribute_plane_at(&span->recipricol_w, triangle, x_start, y);
+    float interpolated_u_over_w = attribute_plane_at(&span->u_over_w, triangle, x_start, y);
+    float interpolated_v_over_w = attribute_plane_at(&span->v_over_w, triangle, x_start, y);
+
+    int num_written = 0;
+    bool is_counting_tiles = span->texture_bytes_touched != NULL;
+    int num_tiles = 0;
+    int previous_tile = -1;
+    for (int x = x_start; x < x_end; ++x) {
+        if (test_and_write_depth(&depth, depth_format, x, interpolated_recipricol_w)) {
+            // one reciprocal recovers both u and v
+            float interpolated_w = 1.0f / interpolated_recipricol_w;
+            float interpolated_u = interpolated_u_over_w * interpolated_w;
+            float interpolated_v = interpolated_v_over_w * interpolated_w;
+
+            int32_t texel_index = get_wrapped_texel_index(level, interpolated_u, interpolated_v);
+            if (is_counting_tiles) {
+                num_tiles += count_touched_tiles(&texel_index, 1, 1, &previous_tile);
+            }
+
+            colour_row[x] = level->texels[texel_index];
+            ++num_written;
+        }
+
+        interpolated_recipricol_w += span->recipricol_w.dx;
+        interpolated_u_over_w += span->u_over_w.dx;
+        interpolated_v_over_w += span->v_over_w.dx;
+    }
+
+    if (is_counting_tiles) {
+        *span->texture_bytes_touched += (uint64_t) num_tiles * TEXTURE_TILE_BYTES;
+    }
+    return num_written;
+}
+
+RASTER_INLINE int draw_textured_span(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data, int depth_format) {
+    const textured_span_t* span = data;
+    const texture_level_t* level = select_texture_level(triangle, span, x_start, y);
+    return draw_textured_pixels(triangle, span, level, y, x_start, x_end, depth_format);
+}
+
+#ifdef RASTER_X86_SIMD
+///////////////////////////////////////////////////////////////////////////////
+// SIMD textured spans
+///////////////////////////////////////////////////////////////////////////////
+// These shade 4 (SSE2) or 8 (AVX2) horizontally adjacent pixels at a time.
+// Lanes start one x step apart and the whole vector then steps by 4 or 8
+// pixels at once, so results can differ from the scalar span in the last
+// bit. Writes are masked so pixels outside the span are never touched.
+// The mip level is chosen once for the span, as in the scalar span.
+///////////////////////////////////////////////////////////////////////////////
+// floor without SSE4.1: truncate, then step down where that rounded up
+__attribute__((target("sse2")))
+static inline __m128i floor_to_int_sse2(__m128 value) {
+    __m128i truncated = _mm_cvttps_epi32(value);
+    __m128 rounded_up = _mm_cmpgt_ps(_mm_cvtepi32_ps(truncated), value);
+    return _mm_add_epi32(truncated, _mm_castps_si128(rounded_up));
+}
+
+// vector form of get_texel_index(), wrapping the coordinates first
+__attribute__((target("sse2")))
+static inline __m128i texel_index_sse2(const texture_level_t* level, __m128i tex_x, __m128i tex_y) {
+    const __m128i tile_mask = _mm_set1_epi32(TEXTURE_TILE_SIZE - 1);
+    tex_x = _mm_and_si128(tex_x, _mm_set1_epi32(level->width_mask));
+    tex_y = _mm_and_si128(tex_y, _mm_set1_epi32(level->height_mask));
+    __m128i tile_row = _mm_sll_epi32(_mm_srli_epi32(tex_y, TEXTURE_TILE_BITS), _mm_cvtsi32_si128(level->tile_row_shift));
+    __m128i tile_column = _mm_slli_epi32(_mm_srli_epi32(tex_x, TEXTURE_TILE_BITS), 2 * TEXTURE_TILE_BITS);
+    __m128i in_tile = _mm_or_si128(
+        _mm_slli_epi32(_mm_and_si128(tex_y, tile_mask), TEXTURE_TILE_BITS),
+        _mm_and_si128(tex_x, tile_mask));
+    return _mm_or_si128(_mm_or_si128(tile_row, tile_column), in_tile);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i texel_index_avx2(const texture_level_t* level, __m256i tex_x, __m256i tex_y) {
+    const __m256i tile_mask = _mm256_set1_epi32(TEXTURE_TILE_SIZE - 1);
+    tex_x = _mm256_and_si256(tex_x, _mm256_set1_epi32(level->width_mask));
+    tex_y = _mm256_and_si256(tex_y, _mm256_set1_epi32(level->height_mask));
+    __m256i tile_row = _mm256_sll_epi32(_mm256_srli_epi32(tex_y, TEXTURE_TILE_BITS), _mm_cvtsi32_si128(level->tile_row_shift));
+    __m256i tile_column = _mm256_slli_epi32(_mm256_srli_epi32(tex_x, TEXTURE_TILE_BITS), 2 * TEXTURE_TILE_BITS);
+    __m256i in_tile = _mm256_or_si256(
+        _mm256_slli_epi32(_mm256_and_si256(tex_y, tile_mask), TEXTURE_TILE_BITS),
+        _mm256_and_si256(tex_x, tile_mask));
+    return _mm256_or_si256(_mm256_or_si256(tile_row, tile_column), in_tile);
+}
+
+// the SIMD depth tests cover the float formats and, with AVX2, 16 bit unorm;
+// spans in other formats are left to the scalar path, whose texture
+// coordinates can round onto a neighbouring texel
+__attribute__((target("sse2")))
+static inline __m128 depth_value_sse2(int format, __m128 recipricol_w) {
+    if (format == DEPTH_REVERSED_FLOAT) {
+        return recipricol_w;
+    }
+    return _mm_sub_ps(_mm_set1_ps(1.0f), recipricol_w);
+}
+
+__attribute__((target("sse2")))
+static inline __m128 test_depth_sse2(int format, __m128 value, __m128 current) {
+    if (format == DEPTH_REVERSED_FLOAT) {
+        return _mm_cmpgt_ps(value, current);
+    }
+    return _mm_cmplt_ps(value, current);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i encode_unorm16_depth_avx2(const depth_row_t* depth, __m256 recipricol_w) {
+    __m256 scaled = _mm256_add_ps(_mm256_mul_ps(recipricol_w, _mm256_set1_ps(depth->unorm_scale)), _mm256_set1_ps(0.5f));
+    return _mm256_min_epi32(_mm256_cvttps_epi32(scaled), _mm256_set1_epi32(DEPTH_UNORM16_MAX));
+}
+
+// 16 bit depths are loaded and stored 8 at a time, so that format must only
+// be used on chunks that lie wholly inside the span
+__attribute__((target("avx2")))
+static inline __m256i test_depth_avx2(const depth_row_t* depth, int format, int x, __m256i active, __m256 recipricol_w) {
+    switch (format) {
+        case DEPTH_REVERSED_FLOAT: {
+            __m256 current = _mm256_maskload_ps((float*) depth->row + x, active);
+            return _mm256_and_si256(active, _mm256_castps_si256(_mm256_cmp_ps(recipricol_w, current, _CMP_GT_OQ)));
+        }
+        case DEPTH_UNORM16: {
+            __m256i current = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) ((uint16_t*) depth->row + x)));
+            return _mm256_cmpgt_epi32(encode_unorm16_depth_avx2(depth, recipricol_w), current);
+        }
+        default: {
+            __m256 z_buffer_w = _mm256_sub_ps(_mm256_set1_ps(1.0f), recipricol_w);
+            __m256 current = _mm256_maskload_ps((float*) depth->row + x, active);
+            return _mm256_and_si256(active, _mm256_castps_si256(_mm256_cmp_ps(z_buffer_w, current, _CMP_LT_OQ)));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void write_depth_avx2(const depth_row_t* depth, int format, int x, __m256i pass, __m256 recipricol_w) {
+    switch (format) {
+        case DEPTH_REVERSED_FLOAT:
+            _mm256_maskstore_ps((float*) depth->row + x, pass, recipricol_w);
+            break;
+        case DEPTH_UNORM16: {
+            __m128i* stored = (__m128i*) ((uint16_t*) depth->row + x);
+            __m256i depths = _mm256_blendv_epi8(
+                _mm256_cvtepu16_epi32(_mm_loadu_si128(stored)), encode_unorm16_depth_avx2(depth, recipricol_w), pass);
+            // packing works within 128 bit halves, so gather the low quarter of each half
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(depths, depths), 0x08);
+            _mm_storeu_si128(stored, _mm256_castsi256_si128(packed));
+            break;
+        }
+        default:
+            _mm256_maskstore_ps((float*) depth->row + x, pass, _mm256_sub_ps(_mm256_set1_ps(1.0f), recipricol_w));
+            break;
+    }
+}
+
+__attribute__((target("sse2")))
+RASTER_INLINE int draw_textured_span_sse2(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data, int depth_format) {
+    const textured_span_t* span = data;
+    const texture_level_t* level = select_texture_level(triangle, span, x_start, y);
+
+    depth_row_t depth = get_depth_row(y);
+    if (depth_format != DEPTH_FLOAT && depth_format != DEPTH_REVERSED_FLOAT) {
+        return draw_textured_pixels(triangle, span, level, y, x_start, x_end, depth_format);
+    }
+
+    uint32_t* colour_row = get_colour_buffer() + y * get_window_width();
+    float* depth_row = depth.row;
+
+    const __m128 lane_offsets = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 texture_width = _mm_set1_ps(level->width);
+    const __m128 texture_height = _mm_set1_ps(level->height);
+
+    __m128 interpolated_recipricol_w = _mm_add_ps(
+        _mm_set1_ps(attribute_plane_at(&span->recipricol_w, triangle, x_start, y)),
+        _mm_mul_ps(lane_offsets, _mm_set1_ps(span->recipricol_w.dx)));
+    __m128 interpolated_u_over_w = _mm_add_ps(
+        _mm_set1_ps(attribute_plane_at(&span->u_over_w, triangle, x_start, y)),
+        _mm_mul_ps(lane_offsets, _mm_set1_ps(span->u_over_w.dx)));
+    __m128 interpolated_v_over_w = _mm_add_ps(
+        _mm_set1_ps(attribute_plane_at(&span->v_over_w, triangle, x_start, y)),
+        _mm_mul_ps(lane_offsets, _mm_set1_ps(span->v_over_w.dx)));
+
+    const __m128 recipricol_w_step = _mm_set1_ps(span->recipricol_w.dx * 4);
+    const __m128 u_over_w_step = _mm_set1_ps(span->u_over_w.dx * 4);
+    const __m128 v_over_w_step = _mm_set1_ps(span->v_over_w.dx * 4);
+
+    int num_written = 0;
+    bool is_counting_tiles = span->texture_bytes_touched != NULL;
+    int num_tiles = 0;
+    int previous_tile = -1;
+    int x = x_start;
+    for (; x + 4 <= x_end; x += 4) {
+        __m128 z_buffer_w = depth_value_sse2(depth_format, interpolated_recipricol_w);
+        __m128 current_z = _mm_loadu_ps(depth_row + x);
+        __m128 depth_pass = test_depth_sse2(depth_format, z_buffer_w, current_z);
+        int pass_mask = _mm_movemask_ps(depth_pass);
+
+        if (pass_mask != 0) {
+            num_written += __builtin_popcount(pass_mask);
+
+            __m128 interpolated_w = _mm_div_ps(_mm_set1_ps(1.0f), interpolated_recipricol_w);
+            __m128 interpolated_u = _mm_mul_ps(interpolated_u_over_w, interpolated_w);
+            __m128 interpolated_v = _mm_mul_ps(interpolated_v_over_w, interpolated_w);
+
+            __m128i tex_x = floor_to_int_sse2(_mm_mul_ps(texture_width, interpolated_u));
+            __m128i tex_y = floor_to_int_sse2(_mm_mul_ps(texture_height, interpolated_v));
+
+            // SSE2 has no gather, so fetch the texels of the passing lanes one by one
+            int32_t lane_index[4];
+            uint32_t texels[4];
+            _mm_storeu_si128((__m128i*) lane_index, texel_index_sse2(level, tex_x, tex_y));
+            for (int lane = 0; lane < 4; ++lane) {
+                texels[lane] = (pass_mask & (1 << lane)) ? level->texels[lane_index[lane]] : 0;
             }
+            if (is_counting_tiles) {
+                num_tiles += count_touched_tiles(lane_index, 4, pass_mask, &previous_tile);
+            }
+
+            __m128i pass = _mm_castps_si128(depth_pass);
+            __m128i current_colour = _mm_loadu_si128((__m128i*) (colour_row + x));
+            __m128i colour = _mm_or_si128(
+                _mm_and_si128(pass, _mm_loadu_si128((__m128i*) texels)),
+                _mm_andnot_si128(pass, current_colour));
+            _mm_storeu_si128((__m128i*) (colour_row + x), colour);
+            _mm_storeu_ps(depth_row + x, _mm_or_ps(
+                _mm_and_ps(depth_pass, z_buffer_w),
+                _mm_andnot_ps(depth_pass, current_z)));
+        }
+
+        interpolated_recipricol_w = _mm_add_ps(interpolated_recipricol_w, recipricol_w_step);
+        interpolated_u_over_w = _mm_add_ps(interpolated_u_over_w, u_over_w_step);
+        interpolated_v_over_w = _mm_add_ps(interpolated_v_over_w, v_over_w_step);
+    }
+
+    if (is_counting_tiles) {
+        *span->texture_bytes_touched += (uint64_t) num_tiles * TEXTURE_TILE_BYTES;
+    }
+
+    if (x < x_end) {
+        num_written += draw_textured_pixels(triangle, span, level, y, x, x_end, depth_format);
+    }
+
+    return num_written;
+}
+
+__attribute__((target("avx2")))
+RASTER_INLINE int draw_textured_span_avx2(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data, int depth_format) {
+    const textured_span_t* span = data;
+    const texture_level_t* level = select_texture_level(triangle, span, x_start, y);
+
+    depth_row_t depth = get_depth_row(y);
+    if (depth_format == DEPTH_UNORM24) {
+        return draw_textured_pixels(triangle, span, level, y, x_start, x_end, depth_format);
+    }
+
+    uint32_t* colour_row = get_colour_buffer() + y * get_window_width();
+
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 lane_offsets = _mm256_cvtepi32_ps(lanes);
+    const __m256 texture_width = _mm256_set1_ps(level->width);
+    const __m256 texture_height = _mm256_set1_ps(level->height);
+
+    __m256 interpolated_recipricol_w = _mm256_add_ps(
+        _mm256_set1_ps(attribute_plane_at(&span->recipricol_w, triangle, x_start, y)),
+        _mm256_mul_ps(lane_offsets, _mm256_set1_ps(span->recipricol_w.dx)));
+    __m256 interpolated_u_over_w = _mm256_add_ps(
+        _mm256_set1_ps(attribute_plane_at(&span->u_over_w, triangle, x_start, y)),
+        _mm256_mul_ps(lane_offsets, _mm256_set1_ps(span->u_over_w.dx)));
+    __m256 interpolated_v_over_w = _mm256_add_ps(
+        _mm256_set1_ps(attribute_plane_at(&span->v_over_w, triangle, x_start, y)),
+        _mm256_mul_ps(lane_offsets, _mm256_set1_ps(span->v_over_w.dx)));
 
-            for (int x = x_start; x < x_end; ++x) {
-                draw_triangle_texel(
-                    x, y, texture,
-                    point_a, point_b, point_c,
-                    recipricol_w_a, recipricol_w_b, recipricol_w_c,
-                    a_uv, b_uv, c_uv
-                );
+    const __m256 recipricol_w_step = _mm256_set1_ps(span->recipricol_w.dx * 8);
+    const __m256 u_over_w_step = _mm256_set1_ps(span->u_over_w.dx * 8);
+    const __m256 v_over_w_step = _mm256_set1_ps(span->v_over_w.dx * 8);
+
+    int num_written = 0;
+    bool is_counting_tiles = span->texture_bytes_touched != NULL;
+    int num_tiles = 0;
+    int previous_tile = -1;
+    for (int x = x_start; x < x_end; x += 8) {
+        if (depth_format == DEPTH_UNORM16 && x + 8 > x_end) {
+            num_written += draw_textured_pixels(triangle, span, level, y, x, x_end, depth_format);
+            break;
+        }
+
+        __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(x_end - x), lanes);
+        __m256i pass = test_depth_avx2(&depth, depth_format, x, active, interpolated_recipricol_w);
+        int pass_mask = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+
+        if (pass_mask != 0) {
+            num_written += __builtin_popcount(pass_mask);
+
+            __m256 interpolated_w = _mm256_div_ps(_mm256_set1_ps(1.0f), interpolated_recipricol_w);
+            __m256 interpolated_u = _mm256_mul_ps(interpolated_u_over_w, interpolated_w);
+            __m256 interpolated_v = _mm256_mul_ps(interpolated_v_over_w, interpolated_w);
+
+            __m256i tex_x = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(texture_width, interpolated_u)));
+            __m256i tex_y = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(texture_height, interpolated_v)));
+            __m256i texel_index = texel_index_avx2(level, tex_x, tex_y);
+            __m256i texels = _mm256_mask_i32gather_epi32(
+                _mm256_setzero_si256(), (const int*) level->texels, texel_index, pass, 4);
+
+            if (is_counting_tiles) {
+                int32_t lane_index[8];
+                _mm256_storeu_si256((__m256i*) lane_index, texel_index);
+                num_tiles += count_touched_tiles(lane_index, 8, pass_mask, &previous_tile);
             }
+
+            _mm256_maskstore_epi32((int*) (colour_row + x), pass, texels);
+            write_depth_avx2(&depth, depth_format, x, pass, interpolated_recipricol_w);
+        }
+
+        interpolated_recipricol_w = _mm256_add_ps(interpolated_recipricol_w, recipricol_w_step);
+        interpolated_u_over_w = _mm256_add_ps(interpolated_u_over_w, u_over_w_step);
+        interpolated_v_over_w = _mm256_add_ps(interpolated_v_over_w, v_over_w_step);
+    }
+
+    if (is_counting_tiles) {
+        *span->texture_bytes_touched += (uint64_t) num_tiles * TEXTURE_TILE_BYTES;
+    }
+    return num_written;
+}
+#endif
+
+// shared by the forward and deferred textured paths so both shade from the
+// same planes; returns false if the triangle covers nothing inside the clip
+static bool setup_textured_triangle(
+    raster_triangle_t* triangle, textured_span_t* span,
+    const triangle_setup_t* setup, const SDL_Rect* clip, raster_stats_t* stats
+) {
+    if (!setup_raster_triangle(triangle, setup, clip)) {
+        return false;
+    }
+
+    const float* recipricol_w = setup->recipricol_w;
+    const float* u = setup->u;
+    const float* v = setup->v;
+    triangle->nearest_depth = nearest_depth(recipricol_w);
+
+    // only meshes whose texture got a handle are loaded, so this is never NULL
+    span->texture = get_texture(setup->texture);
+    span->texture_bytes_touched = is_counting_texture_tiles ? &stats->texture_bytes_touched : NULL;
+    span->recipricol_w = make_attribute_plane(triangle, recipricol_w[0], recipricol_w[1], recipricol_w[2]);
+    span->u_over_w = make_attribute_plane(triangle, u[0] * recipricol_w[0], u[1] * recipricol_w[1], u[2] * recipricol_w[2]);
+    span->v_over_w = make_attribute_plane(triangle, v[0] * recipricol_w[0], v[1] * recipricol_w[1], v[2] * recipricol_w[2]);
+    return true;
+}
+
+static void draw_textured_triangle(const triangle_setup_t* setup, const SDL_Rect* clip, raster_stats_t* stats) {
+    raster_triangle_t triangle;
+    textured_span_t span;
+    if (setup_textured_triangle(&triangle, &span, setup, clip, stats)) {
+        rasterize_triangle(&triangle, kernels.textured_span, &span, stats);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Visibility buffer
+///////////////////////////////////////////////////////////////////////////////
+// The visibility pass rasterizes depth and the index of the triangle that
+// owns each pixel, nothing else. Once every triangle has been drawn, the
+// resolve pass walks the pixels, sets up the owning triangle's planes and
+// shades each covered pixel exactly once, however many triangles were
+// drawn over it.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint32_t triangle_id;
+    attribute_plane_t recipricol_w;
+} visibility_span_t;
+
+RASTER_INLINE int draw_visibility_span(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data, int depth_format) {
+    const visibility_span_t* span = data;
+
+    uint32_t* visibility_row = get_visibility_buffer() + y * get_window_width();
+    depth_row_t depth = get_depth_row(y);
+    float interpolated_recipricol_w = attribute_plane_at(&span->recipricol_w, triangle, x_start, y);
+
+    int num_written = 0;
+    for (int x = x_start; x < x_end; ++x) {
+        if (test_and_write_depth(&depth, depth_format, x, interpolated_recipricol_w)) {
+            visibility_row[x] = span->triangle_id;
+            ++num_written;
+        }
+
+        interpolated_recipricol_w += span->recipricol_w.dx;
+    }
+
+    return num_written;
+}
+
+static void draw_visibility_triangle(const triangle_setup_t* setup, uint32_t triangle_id, const SDL_Rect* clip, raster_stats_t* stats) {
+    raster_triangle_t triangle;
+    if (!setup_raster_triangle(&triangle, setup, clip)) {
+        return;
+    }
+
+    const float* recipricol_w = setup->recipricol_w;
+    triangle.nearest_depth = nearest_depth(recipricol_w);
+
+    visibility_span_t span = {
+        .triangle_id = triangle_id,
+        .recipricol_w = make_attribute_plane(&triangle, recipricol_w[0], recipricol_w[1], recipricol_w[2])
+    };
+
+    rasterize_triangle(&triangle, kernels.visibility_span, &span, stats);
+}
+
+// shades a run of pixels already known to be visible, no depth test needed
+static void resolve_textured_pixels(const raster_triangle_t* triangle, const textured_span_t* span, int y, int x_start, int x_end) {
+    const texture_level_t* level = select_texture_level(triangle, span, x_start, y);
+    uint32_t* colour_row = get_colour_buffer() + y * get_window_width();
+
+    float interpolated_recipricol_w = attribute_plane_at(&span->recipricol_w, triangle, x_start, y);
+    float interpolated_u_over_w = attribute_plane_at(&span->u_over_w, triangle, x_start, y);
+    float interpolated_v_over_w = attribute_plane_at(&span->v_over_w, triangle, x_start, y);
+
+    bool is_counting_tiles = span->texture_bytes_touched != NULL;
+    int num_tiles = 0;
+    int previous_tile = -1;
+    for (int x = x_start; x < x_end; ++x) {
+        float interpolated_w = 1.0f / interpolated_recipricol_w;
+        int32_t texel_index = get_wrapped_texel_index(level, interpolated_u_over_w * interpolated_w, interpolated_v_over_w * interpolated_w);
+        if (is_counting_tiles) {
+            num_tiles += count_touched_tiles(&texel_index, 1, 1, &previous_tile);
         }
+        colour_row[x] = level->texels[texel_index];
+
+        interpolated_recipricol_w += span->recipricol_w.dx;
+        interpolated_u_over_w += span->u_over_w.dx;
+        interpolated_v_over_w += span->v_over_w.dx;
     }
 
-    // render flat-top triangle
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
+    if (is_counting_tiles) {
+        *span->texture_bytes_touched += (uint64_t) num_tiles * TEXTURE_TILE_BYTES;
+    }
+}
 
-    if (y2 - y1 != 0) inv_slope_1 = (float) (x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0) inv_slope_2 = (float) (x2 - x0) / abs(y2 - y0);
+// triangles must be the array the visibility pass took its ids from
+void resolve_visibility_buffer(const triangle_setup_t* triangles, const SDL_Rect* clip, raster_stats_t* stats) {
+    SDL_Rect rect = get_clip_rect(clip);
+    const uint32_t* visibility_buffer = get_visibility_buffer();
+    int window_width = get_window_width();
 
-    if (y2 - y1 != 0) {
-        for (int y = y1; y <= y2; ++y) {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+    // neighbouring pixels mostly share a triangle, so its setup is kept
+    // until a pixel owned by another one turns up
+    uint32_t current_id = UINT32_MAX;
+    bool is_current_visible = false;
+    raster_triangle_t triangle;
+    textured_span_t span;
 
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
+    for (int y = rect.y; y < rect.y + rect.h; ++y) {
+        const uint32_t* visibility_row = visibility_buffer + y * window_width;
+
+        int x = rect.x;
+        while (x < rect.x + rect.w) {
+            // runs stop at block edges so mip levels are picked as often as
+            // they are when rasterizing
+            int block_end = (x | (RASTER_BLOCK_SIZE - 1)) + 1;
+            if (block_end > rect.x + rect.w) {
+                block_end = rect.x + rect.w;
             }
 
-            for (int x = x_start; x < x_end; ++x) {
-                draw_triangle_texel(
-                    x, y, texture,
-                    point_a, point_b, point_c,
-                    recipricol_w_a, recipricol_w_b, recipricol_w_c,
-                    a_uv, b_uv, c_uv
-                );
+            // ids in tiles nothing was drawn into are left over from earlier frames
+            if (is_tile_depth_cleared(x, y)) {
+                x = block_end;
+                continue;
+            }
+
+            uint32_t id = visibility_row[x];
+            if (id == NO_TRIANGLE_ID) {
+                ++x;
+                continue;
+            }
+
+            int run_end = x + 1;
+            while (run_end < block_end && visibility_row[run_end] == id) {
+                ++run_end;
+            }
+
+            if (id != current_id) {
+                current_id = id;
+                is_current_visible = setup_textured_triangle(&triangle, &span, &triangles[id], NULL, stats);
+            }
+
+            if (is_current_visible) {
+                resolve_textured_pixels(&triangle, &span, y, x, run_end);
+            }
+            x = run_end;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Raster kernels
+///////////////////////////////////////////////////////////////////////////////
+// The span shaders above take the depth format as an argument and are
+// always inlined, so instantiating them once per format with a constant
+// leaves each copy with a single depth test and no per-pixel switch. The
+// passes a render method runs are instantiated the same way, one triangle
+// list kernel per method. select_raster_kernels picks the copies for the
+// current render method and depth format once per frame; the per-triangle
+// and per-pixel loops never look at either setting.
+///////////////////////////////////////////////////////////////////////////////
+#define DEFINE_SPAN_KERNEL(shader, suffix, format, target_attribute) \
+    target_attribute static int shader##_##suffix(const raster_triangle_t* triangle, int y, int x_start, int x_end, const void* data) { \
+        return shader(triangle, y, x_start, x_end, data, format); \
+    }
+
+#define DEFINE_DEPTH_SPAN_KERNELS(shader, target_attribute) \
+    DEFINE_SPAN_KERNEL(shader, float, DEPTH_FLOAT, target_attribute) \
+    DEFINE_SPAN_KERNEL(shader, reversed_float, DEPTH_REVERSED_FLOAT, target_attribute) \
+    DEFINE_SPAN_KERNEL(shader, unorm16, DEPTH_UNORM16, target_attribute) \
+    DEFINE_SPAN_KERNEL(shader, unorm24, DEPTH_UNORM24, target_attribute)
+
+// indexed by depth_format
+#define DEPTH_SPAN_KERNELS(shader) { shader##_float, shader##_reversed_float, shader##_unorm16, shader##_unorm24 }
+
+DEFINE_DEPTH_SPAN_KERNELS(draw_filled_span, )
+DEFINE_DEPTH_SPAN_KERNELS(draw_textured_span, )
+DEFINE_DEPTH_SPAN_KERNELS(draw_visibility_span, )
+
+static const span_shader_t filled_span_kernels[NUM_DEPTH_FORMATS] = DEPTH_SPAN_KERNELS(draw_filled_span);
+static const span_shader_t visibility_span_kernels[NUM_DEPTH_FORMATS] = DEPTH_SPAN_KERNELS(draw_visibility_span);
+static const span_shader_t scalar_textured_span_kernels[NUM_DEPTH_FORMATS] = DEPTH_SPAN_KERNELS(draw_textured_span);
+
+#ifdef RASTER_X86_SIMD
+DEFINE_DEPTH_SPAN_KERNELS(draw_textured_span_sse2, __attribute__((target("sse2"))))
+DEFINE_DEPTH_SPAN_KERNELS(draw_textured_span_avx2, __attribute__((target("avx2"))))
+
+static const span_shader_t sse2_textured_span_kernels[NUM_DEPTH_FORMATS] = DEPTH_SPAN_KERNELS(draw_textured_span_sse2);
+static const span_shader_t avx2_textured_span_kernels[NUM_DEPTH_FORMATS] = DEPTH_SPAN_KERNELS(draw_textured_span_avx2);
+#endif
+
+static const span_shader_t* textured_span_kernels = scalar_textured_span_kernels;
+
+void initialise_rasterizer(void) {
+#ifdef RASTER_X86_SIMD
+    if (SDL_HasAVX2()) {
+        textured_span_kernels = avx2_textured_span_kernels;
+    } else if (SDL_HasSSE2()) {
+        textured_span_kernels = sse2_textured_span_kernels;
+    }
+#endif
+}
+
+// The wireframe and the vertex markers have no depth test, so if they were
+// drawn per triangle the draw order would decide which edges a later
+// triangle paints over. They are drawn in passes of their own after the
+// surfaces instead, all lines and then all markers. Every line is the same
+// colour and so is every marker, so the image doesn't depend on the order
+// the triangles come in. Triangle ids, as used by the visibility buffer,
+// are indices into the batch; without an index list the whole batch is
+// drawn in order.
+RASTER_INLINE void draw_triangle_passes(
+    const triangle_setup_t* triangles, const int* indices, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats,
+    bool fill, bool texture, bool visibility, bool wireframe, bool wire_vertex
+) {
+    if (fill || texture || visibility) {
+        for (int i = 0; i < num_triangles; ++i) {
+            int id = indices ? indices[i] : i;
+            if (fill) {
+                draw_filled_triangle(&triangles[id], clip, stats);
+            }
+            if (texture) {
+                draw_textured_triangle(&triangles[id], clip, stats);
+            }
+            if (visibility) {
+                draw_visibility_triangle(&triangles[id], id, clip, stats);
             }
         }
     }
+
+    if (wireframe) {
+        for (int i = 0; i < num_triangles; ++i) {
+            const triangle_setup_t* triangle = &triangles[indices ? indices[i] : i];
+            draw_triangle(
+                triangle->x[0], triangle->y[0],
+                triangle->x[1], triangle->y[1],
+                triangle->x[2], triangle->y[2],
+                0xFFFFFFFF, clip);
+        }
+    }
+
+    if (wire_vertex) {
+        for (int i = 0; i < num_triangles; ++i) {
+            const triangle_setup_t* triangle = &triangles[indices ? indices[i] : i];
+            draw_rect(triangle->x[0] - 3, triangle->y[0] - 3, 6, 6, 0xFFFF0000, clip);
+            draw_rect(triangle->x[1] - 3, triangle->y[1] - 3, 6, 6, 0xFFFF0000, clip);
+            draw_rect(triangle->x[2] - 3, triangle->y[2] - 3, 6, 6, 0xFFFF0000, clip);
+        }
+    }
+}
+
+#define DEFINE_TRIANGLE_LIST_KERNEL(name, fill, texture, visibility, wireframe, wire_vertex) \
+    static void name( \
+        const triangle_setup_t* triangles, const int* indices, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats \
+    ) { \
+        draw_triangle_passes(triangles, indices, num_triangles, clip, stats, fill, texture, visibility, wireframe, wire_vertex); \
+    }
+
+//                          name                               fill   texture visibility wireframe wire_vertex
+DEFINE_TRIANGLE_LIST_KERNEL(draw_wire_kernel,                  false, false,  false,     true,     false)
+DEFINE_TRIANGLE_LIST_KERNEL(draw_wire_vertex_kernel,           false, false,  false,     true,     true)
+DEFINE_TRIANGLE_LIST_KERNEL(draw_fill_triangle_kernel,         true,  false,  false,     false,    false)
+DEFINE_TRIANGLE_LIST_KERNEL(draw_fill_triangle_wire_kernel,    true,  false,  false,     true,     false)
+DEFINE_TRIANGLE_LIST_KERNEL(draw_textured_kernel,              false, true,   false,     false,    false)
+DEFINE_TRIANGLE_LIST_KERNEL(draw_textured_wire_kernel,         false, true,   false,     true,     false)
+DEFINE_TRIANGLE_LIST_KERNEL(draw_visibility_buffer_kernel,     false, false,  true,      false,    false)
+
+// indexed by render_method, the one place that says which passes each runs
+static const triangle_list_kernel_t triangle_list_kernels[NUM_RENDER_METHODS] = {
+    draw_wire_kernel,
+    draw_wire_vertex_kernel,
+    draw_fill_triangle_kernel,
+    draw_fill_triangle_wire_kernel,
+    draw_textured_kernel,
+    draw_textured_wire_kernel,
+    draw_visibility_buffer_kernel
+};
+
+void select_raster_kernels(void) {
+    int depth_format = get_depth_format();
+    kernels.filled_span = filled_span_kernels[depth_format];
+    kernels.textured_span = textured_span_kernels[depth_format];
+    kernels.visibility_span = visibility_span_kernels[depth_format];
+    kernels.draw_triangle_list = triangle_list_kernels[get_render_method()];
+}
+
+void draw_binned_triangles(
+    const triangle_setup_t* triangles, const int* indices, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats
+) {
+    kernels.draw_triangle_list(triangles, indices, num_triangles, clip, stats);
+}
+
+void draw_triangles(const triangle_setup_t* triangles, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats) {
+    kernels.draw_triangle_list(triangles, NULL, num_triangles, clip, stats);
+}
+
+void add_raster_stats(raster_stats_t* total, const raster_stats_t* stats) {
+    total->pixels_tested += stats->pixels_tested;
+    total->pixels_written += stats->pixels_written;
+    total->hi_z_rejected_pixels += stats->hi_z_rejected_pixels;
+    total->texture_bytes_touched += stats->texture_bytes_touched;
 }
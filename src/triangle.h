@@ -1,10 +1,11 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <SDL.h>
 #include "texture.h"
 #include "vector.h"
-#include "upng.h"
 
 typedef struct {
     int a;
@@ -14,30 +15,53 @@ typedef struct {
     tex2_t b_uv;
     tex2_t c_uv;
     uint32_t colour;
+    vec3_t normal; // object space plane, dot(normal, p) == distance on the face
+    float distance;
 } face_t;
 
 typedef struct {
     vec4_t points[3];
     tex2_t texcoords[3];
     uint32_t colour;
-    upng_t* texture;
+    texture_t* texture;
 } triangle_t;
 
+// a screen space triangle as the rasterizer wants it, built once by the
+// geometry stage so drawing it needs no further unpacking. Vertices are wound
+// clockwise at sub-pixel precision and v is flipped to texture rows. One
+// cache line each
+typedef struct {
+    float x[3];
+    float y[3];
+    float recipricol_w[3];
+    float u[3];
+    float v[3];
+    uint32_t colour : 24; // flat shaded rgb, faces are always opaque
+    uint32_t texture : 8; // texture handle
+} triangle_setup_t;
+
+// rasterizer work counters, kept per thread and summed per frame
+typedef struct {
+    uint64_t pixels_tested;
+    uint64_t pixels_written;
+    uint64_t hi_z_rejected_pixels; // bounding box pixels in blocks hidden by the hi-z buffer
+    uint64_t texture_bytes_touched; // texel tiles fetched by textured spans, in bytes
+} raster_stats_t;
+
 vec3_t get_triangle_normal(vec4_t vertices[3]);
 
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t colour);
-void draw_filled_triangle(
-    int x0, int y0, float z0, float w0,
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    uint32_t colour
-);
-void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0,
-    int x1, int y1, float z1, float w1, float u1, float v1,
-    int x2, int y2, float z2, float w2, float u2, float v2,
-    upng_t* texture
-);
+void initialise_rasterizer(void);
+void select_raster_kernels(void);
+void toggle_mipmapping(void);
+void set_texture_stats_enabled(bool enabled);
+
+void setup_triangle(triangle_setup_t* setup, const triangle_t* triangle);
+
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t colour, const SDL_Rect* clip);
+void resolve_visibility_buffer(const triangle_setup_t* triangles, const SDL_Rect* clip, raster_stats_t* stats);
+void draw_binned_triangles(const triangle_setup_t* triangles, const int* indices, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats);
+void draw_triangles(const triangle_setup_t* triangles, int num_triangles, const SDL_Rect* clip, raster_stats_t* stats);
+void add_raster_stats(raster_stats_t* total, const raster_stats_t* stats);
 
 void draw_texel(
     int x, int y, uint32_t* texture,
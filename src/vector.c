@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stddef.h>
 #include "vector.h"
 
 vec2_t vec2_new(float x, float y) {
@@ -162,3 +163,13 @@ vec2_t vec2_from_vec4(vec4_t v) {
     vec2_t result = { v.x, v.y };
     return result;
 }
+
+vec4_t vec4_from_streams(const vec4_streams_t* streams, int index) {
+    vec4_t result = {
+        streams->x[index],
+        streams->y[index],
+        streams->z[index],
+        streams->w != NULL ? streams->w[index] : 1.0f
+    };
+    return result;
+}
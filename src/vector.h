@@ -13,6 +13,15 @@ typedef struct {
     float x, y, z, w;
 } vec4_t;
 
+// many points as structure of arrays, one stream per component; w is NULL
+// for points whose w is implicitly 1
+typedef struct {
+    float* x;
+    float* y;
+    float* z;
+    float* w;
+} vec4_streams_t;
+
 // vec2
 vec2_t vec2_new(float x, float y);
 float vec2_length(vec2_t v);
@@ -43,5 +52,6 @@ vec3_t vec3_rotate_z(vec3_t v, float angle);
 vec4_t vec4_from_vec3(vec3_t v);
 vec3_t vec3_from_vec4(vec4_t v);
 vec2_t vec2_from_vec4(vec4_t v);
+vec4_t vec4_from_streams(const vec4_streams_t* streams, int index);
 
 #endif
@@ -0,0 +1,169 @@
+// Draws triangles that cross the edges of the screen twice, once clipped to
+// the screen edges and once left whole inside the guard band for the
+// rasterizer to scissor, and checks that they only differ on pixels whose
+// centres sit on an edge. Exits non-zero if any case fails.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clipping.h"
+#include "display.h"
+#include "matrix.h"
+#include "triangle.h"
+
+#define TEST_WIDTH 160
+#define TEST_HEIGHT 90
+
+// clipping moves the vertices off the snapped grid, so a pixel centre lying
+// within a sub-pixel step of the exact edge may land on either side of it
+#define EDGE_TOLERANCE (1.0 / 16)
+
+typedef struct {
+    const char* name;
+    vec3_t vertices[3]; // in view space, all in front of the eye
+} test_case_t;
+
+static const test_case_t edge_cases[] = {
+    { "crosses the left edge", { { -8, -1, 5 }, { 2, 2, 5 }, { 1, -2, 5 } } },
+    { "covers the screen", { { -15, -10, 6 }, { 0, 12, 6 }, { 15, -10, 6 } } },
+    { "crosses two edges in depth", { { 3, -1, 4 }, { 9, -6, 8 }, { -1, -7, 6 } } },
+    { "crosses the top and bottom", { { -1, -9, 5 }, { 0.5f, 9, 5 }, { 2, -8, 7 } } },
+    { "reaches past the guard band", { { -60, -2, 5 }, { 3, 30, 9 }, { 40, -3, 6 } } }
+};
+
+// unclipped, this spans more pixels than the edge functions can hold
+static const test_case_t huge_case = {
+    "reaches past the fixed point range", { { -1e5f, 0.3f, 1 }, { 1e5f, 0.1f, 1 }, { 0, -1e5f, 1 } }
+};
+
+static mat4_t proj_matrix;
+static uint32_t reference[TEST_WIDTH * TEST_HEIGHT];
+
+static void set_up_view(float guard_band_extent) {
+    float aspect_ratio_y = (float) TEST_HEIGHT / TEST_WIDTH;
+    float fov_y = M_PI / 3.0f;
+    float fov_x = atan(tan(fov_y / 2.0f) / aspect_ratio_y) * 2;
+    float znear = 0.1;
+    float zfar = 100.0;
+    proj_matrix = mat4_make_perspective(fov_y, aspect_ratio_y, znear, zfar);
+    set_depth_near_plane(znear);
+
+    set_guard_band_extent(guard_band_extent);
+    initialise_frustum_planes(fov_x, fov_y, znear, zfar);
+}
+
+static vec4_t project_to_screen(vec4_t point) {
+    point = vec4_perspective_divide(mat4_mul_vec4(proj_matrix, point));
+    point.x = point.x * (TEST_WIDTH / 2.0) + (TEST_WIDTH / 2.0);
+    point.y = -point.y * (TEST_HEIGHT / 2.0) + (TEST_HEIGHT / 2.0);
+    return point;
+}
+
+// the clipping, projection and setup stages of the geometry pipeline for one
+// face, then the rasterizer; leaves the frame in the colour buffer
+static void draw_test_case(const test_case_t* test_case, float guard_band_extent) {
+    set_up_view(guard_band_extent);
+
+    tex2_t texcoord = { 0, 0 };
+    polygon_t polygon = create_polygon_from_triangle(
+        test_case->vertices[0], test_case->vertices[1], test_case->vertices[2],
+        texcoord, texcoord, texcoord);
+    clip_polygon(&polygon);
+
+    triangle_t triangles[MAX_NUM_POLY_TRIANGLES];
+    int num_triangles = 0;
+    triangles_from_polygon(&polygon, triangles, &num_triangles);
+
+    triangle_setup_t setups[MAX_NUM_POLY_TRIANGLES];
+    for (int t = 0; t < num_triangles; ++t) {
+        for (int j = 0; j < 3; ++j) {
+            triangles[t].points[j] = project_to_screen(triangles[t].points[j]);
+        }
+        triangles[t].colour = 0xFFFFFFFF;
+        triangles[t].texture = NULL;
+        setup_triangle(&setups[t], &triangles[t]);
+    }
+
+    raster_stats_t stats = { 0 };
+    clear_colour_buffer(0xFF000000, 0xFF000000, NULL);
+    clear_z_buffer(NULL);
+    select_raster_kernels();
+    draw_triangles(setups, num_triangles, NULL, &stats);
+    resolve_fast_clears(NULL);
+}
+
+// distance in pixels from the pixel's centre to the nearest edge of the
+// face as projected without any clipping
+static double distance_to_nearest_edge(const test_case_t* test_case, int x, int y) {
+    double nearest = INFINITY;
+    for (int i = 0; i < 3; ++i) {
+        vec4_t a = project_to_screen(vec4_from_vec3(test_case->vertices[i]));
+        vec4_t b = project_to_screen(vec4_from_vec3(test_case->vertices[(i + 1) % 3]));
+        double edge_x = (double) b.x - a.x;
+        double edge_y = (double) b.y - a.y;
+        double cross = edge_x * (y + 0.5 - a.y) - edge_y * (x + 0.5 - a.x);
+        double distance = fabs(cross) / hypot(edge_x, edge_y);
+        if (distance < nearest) {
+            nearest = distance;
+        }
+    }
+    return nearest;
+}
+
+static int count_covered(const uint32_t* pixels) {
+    int count = 0;
+    for (int i = 0; i < TEST_WIDTH * TEST_HEIGHT; ++i) {
+        count += pixels[i] != 0xFF000000;
+    }
+    return count;
+}
+
+// compares the colour buffer with the reference, only letting pixels that
+// sit on an edge differ when a tolerance is given
+static bool check_against_reference(const test_case_t* test_case, float guard_band_extent, double tolerance) {
+    const uint32_t* pixels = get_colour_buffer();
+    int num_differing = 0;
+    int num_off_edge = 0;
+    for (int i = 0; i < TEST_WIDTH * TEST_HEIGHT; ++i) {
+        if (pixels[i] != reference[i]) {
+            ++num_differing;
+            if (!(distance_to_nearest_edge(test_case, i % TEST_WIDTH, i / TEST_WIDTH) < tolerance)) {
+                ++num_off_edge;
+            }
+        }
+    }
+
+    bool passed = num_off_edge == 0 && count_covered(reference) > 0;
+    printf("%s: %s at guard band %g, %d of %d pixels differ, %d away from an edge\n",
+        passed ? "pass" : "FAIL", test_case->name, guard_band_extent,
+        num_differing, count_covered(reference), num_off_edge);
+    return passed;
+}
+
+int main(void) {
+    initialise_frame_buffers(TEST_WIDTH, TEST_HEIGHT);
+    initialise_rasterizer();
+    set_render_method(RENDER_FILL_TRIANGLE);
+    set_depth_format(DEPTH_FLOAT);
+
+    int num_failed = 0;
+    int num_edge_cases = sizeof(edge_cases) / sizeof(edge_cases[0]);
+    for (int i = 0; i < num_edge_cases; ++i) {
+        draw_test_case(&edge_cases[i], 1.0f);
+        memcpy(reference, get_colour_buffer(), sizeof(reference));
+
+        draw_test_case(&edge_cases[i], DEFAULT_GUARD_BAND_EXTENT);
+        num_failed += !check_against_reference(&edge_cases[i], DEFAULT_GUARD_BAND_EXTENT, EDGE_TOLERANCE);
+    }
+
+    // clipping to the screen loses too much precision on a face this large
+    // to serve as the reference, so an out of range extent has to draw
+    // exactly what the largest one the rasterizer can hold draws
+    draw_test_case(&huge_case, MAX_GUARD_BAND_EXTENT);
+    memcpy(reference, get_colour_buffer(), sizeof(reference));
+    draw_test_case(&huge_case, 1e9f);
+    num_failed += !check_against_reference(&huge_case, 1e9f, 0.0);
+
+    free_frame_buffers();
+    return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}